@@ -0,0 +1,398 @@
+#ifndef BLOXORZ_AUDIO_H
+#define BLOXORZ_AUDIO_H
+
+// Sound effects played in process : clips are decoded once up front into
+// 16 bit PCM and mixed on a dedicated thread, which the game feeds through a
+// lock-free single producer / single consumer command queue so a key press
+// never waits on audio.  The mixer writes to a sink : ALSA, a WAV file, or
+// nothing at all for machines without a sound card.
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+
+#include <mpg123.h>
+#include <alsa/asoundlib.h>
+
+namespace audio {
+
+/* Interleaved 16 bit PCM */
+struct Sound {
+    int rate;
+    int channels;
+    std::vector < int16_t > samples;
+
+    Sound ( ) : rate ( 0 ), channels ( 0 ) { }
+
+    size_t frames ( ) const
+    {
+        return channels ? samples.size ( ) / channels : 0;
+    }
+};
+
+/* Decode at most maxFrames MPEG frames of an MP3 file, all of it when maxFrames is 0 */
+inline bool decodeMp3 ( const char *path, long maxFrames, Sound &sound, std::string &error )
+{
+    static bool initialised = mpg123_init ( ) == MPG123_OK;
+    if ( ! initialised ) {
+        error = "cannot initialise mpg123";
+        return false;
+    }
+
+    int status;
+    mpg123_handle *decoder = mpg123_new ( NULL, &status );
+    if ( ! decoder ) {
+        error = mpg123_plain_strerror ( status );
+        return false;
+    }
+
+    // whatever the rate and channels of the file, always decode to signed 16 bit
+    long rate;
+    int channels, encoding;
+    mpg123_format_none ( decoder );
+    const long *rates;
+    size_t rateCount;
+    mpg123_rates ( &rates, &rateCount );
+    for ( size_t r = 0; r < rateCount; r++ )
+        mpg123_format ( decoder, rates[ r ], MPG123_MONO | MPG123_STEREO, MPG123_ENC_SIGNED_16 );
+
+    if ( mpg123_open ( decoder, path ) != MPG123_OK || mpg123_getformat ( decoder, &rate, &channels, &encoding ) != MPG123_OK ) {
+        error = std::string ( path ) + " : " + mpg123_strerror ( decoder );
+        mpg123_delete ( decoder );
+        return false;
+    }
+
+    sound.rate = rate;
+    sound.channels = channels;
+    sound.samples.clear ( );
+    for ( long frame = 0; maxFrames == 0 || frame < maxFrames; frame++ ) {
+        off_t number;
+        unsigned char *pcm;
+        size_t bytes;
+        status = mpg123_decode_frame ( decoder, &number, &pcm, &bytes );
+        if ( status == MPG123_DONE )
+            break;
+        if ( status != MPG123_OK && status != MPG123_NEW_FORMAT ) {
+            error = std::string ( path ) + " : " + mpg123_strerror ( decoder );
+            mpg123_close ( decoder );
+            mpg123_delete ( decoder );
+            return false;
+        }
+        const int16_t *samples = ( const int16_t * ) pcm;
+        sound.samples.insert ( sound.samples.end ( ), samples, samples + bytes / sizeof ( int16_t ) );
+    }
+
+    mpg123_close ( decoder );
+    mpg123_delete ( decoder );
+    return true;
+}
+
+/* Bounded lock-free queue for one producer thread and one consumer thread */
+template < typename T, size_t capacity >
+class SpscQueue {
+public:
+    SpscQueue ( ) : head ( 0 ), tail ( 0 ) { }
+
+    /* Producer side, false when the queue is full */
+    bool push ( const T &item )
+    {
+        size_t t = tail.load ( std::memory_order_relaxed );
+        if ( t - head.load ( std::memory_order_acquire ) == capacity )
+            return false;
+        items[ t % capacity ] = item;
+        tail.store ( t + 1, std::memory_order_release );
+        return true;
+    }
+
+    /* Consumer side, false when the queue is empty */
+    bool pop ( T &item )
+    {
+        size_t h = head.load ( std::memory_order_relaxed );
+        if ( h == tail.load ( std::memory_order_acquire ) )
+            return false;
+        item = items[ h % capacity ];
+        head.store ( h + 1, std::memory_order_release );
+        return true;
+    }
+
+private:
+    T items [ capacity ];
+    std::atomic < size_t > head;
+    std::atomic < size_t > tail;
+};
+
+/* Where mixed audio goes; a sink that does not block is paced to real time by the mixer */
+class Sink {
+public:
+    virtual ~Sink ( ) { }
+    virtual bool open ( int rate, int channels ) = 0;
+    virtual void write ( const int16_t *samples, size_t frames ) = 0;
+    virtual void close ( ) { }
+    virtual bool blocking ( ) const { return false; }
+};
+
+/* Discards everything, only counting what it was given */
+class NullSink : public Sink {
+public:
+    NullSink ( ) : written ( 0 ) { }
+    bool open ( int, int ) { return true; }
+    void write ( const int16_t *, size_t frames ) { written += frames; }
+
+    std::atomic < long > written;
+};
+
+/* Records the session as a 16 bit PCM WAV file */
+class WavSink : public Sink {
+public:
+    explicit WavSink ( const std::string &p ) : path ( p ), file ( NULL ), rate ( 0 ), channels ( 0 ), frames ( 0 ) { }
+    ~WavSink ( ) { close ( ); }
+
+    bool open ( int r, int c )
+    {
+        rate = r;
+        channels = c;
+        frames = 0;
+        file = fopen ( path.c_str ( ), "wb" );
+        if ( ! file )
+            return false;
+        header ( );
+        return true;
+    }
+
+    void write ( const int16_t *samples, size_t count )
+    {
+        fwrite ( samples, sizeof ( int16_t ) * channels, count, file );
+        frames += count;
+    }
+
+    /* Rewrite the header now that the sizes are known */
+    void close ( )
+    {
+        if ( ! file )
+            return;
+        fseek ( file, 0, SEEK_SET );
+        header ( );
+        fclose ( file );
+        file = NULL;
+    }
+
+private:
+    void header ( )
+    {
+        uint32_t data = frames * channels * sizeof ( int16_t );
+        uint32_t riff = 36 + data, formatSize = 16, byteRate = rate * channels * sizeof ( int16_t );
+        uint16_t format = 1, channelCount = channels, align = channels * sizeof ( int16_t ), bits = 16;
+        uint32_t sampleRate = rate;
+        fwrite ( "RIFF", 1, 4, file );
+        fwrite ( &riff, 4, 1, file );
+        fwrite ( "WAVEfmt ", 1, 8, file );
+        fwrite ( &formatSize, 4, 1, file );
+        fwrite ( &format, 2, 1, file );
+        fwrite ( &channelCount, 2, 1, file );
+        fwrite ( &sampleRate, 4, 1, file );
+        fwrite ( &byteRate, 4, 1, file );
+        fwrite ( &align, 2, 1, file );
+        fwrite ( &bits, 2, 1, file );
+        fwrite ( "data", 1, 4, file );
+        fwrite ( &data, 4, 1, file );
+    }
+
+    std::string path;
+    FILE *file;
+    int rate;
+    int channels;
+    long frames;
+};
+
+/* Default ALSA device; writes block, which paces the mixer */
+class AlsaSink : public Sink {
+public:
+    AlsaSink ( ) : pcm ( NULL ) { }
+    ~AlsaSink ( ) { close ( ); }
+
+    bool open ( int rate, int channels )
+    {
+        if ( snd_pcm_open ( &pcm, "default", SND_PCM_STREAM_PLAYBACK, 0 ) < 0 ) {
+            pcm = NULL;
+            return false;
+        }
+        // 50 ms of latency, resampling allowed
+        if ( snd_pcm_set_params ( pcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED, channels, rate, 1, 50000 ) < 0 ) {
+            close ( );
+            return false;
+        }
+        return true;
+    }
+
+    void write ( const int16_t *samples, size_t frames )
+    {
+        snd_pcm_sframes_t written = snd_pcm_writei ( pcm, samples, frames );
+        if ( written < 0 )
+            snd_pcm_recover ( pcm, written, 1 );
+    }
+
+    void close ( )
+    {
+        if ( pcm ) {
+            snd_pcm_drain ( pcm );
+            snd_pcm_close ( pcm );
+        }
+        pcm = NULL;
+    }
+
+    bool blocking ( ) const { return true; }
+
+private:
+    snd_pcm_t *pcm;
+};
+
+/* Mixer thread playing loaded sounds on request */
+class Engine {
+public:
+    static const int max_voices = 16;
+    static const size_t period = 512;       // frames mixed per sink write
+
+    Engine ( ) : rate ( 0 ), channels ( 0 ), running ( false ), dropped ( 0 ) { }
+    ~Engine ( ) { stop ( ); }
+
+    /* Add a sound before start, returning its id; it is played at the engine rate, mono sounds on every channel */
+    int load ( const Sound &sound )
+    {
+        sounds.push_back ( sound );
+        return sounds.size ( ) - 1;
+    }
+
+    /* Open the sink at the given format and start mixing; the engine owns the sink from here,
+       and one that fails to open is deleted */
+    bool start ( std::unique_ptr < Sink > s, int r, int c )
+    {
+        stop ( );
+        if ( ! s->open ( r, c ) )
+            return false;
+        sink = std::move ( s );
+        rate = r;
+        channels = c;
+        running.store ( true );
+        mixer = std::thread ( &Engine::mix, this );
+        return true;
+    }
+
+    void stop ( )
+    {
+        if ( ! running.load ( ) )
+            return;
+        running.store ( false );
+        mixer.join ( );
+        sink->close ( );
+    }
+
+    /* Called from the game thread : never blocks, a request is dropped if the queue is full */
+    void play ( int sound, float gain = 1.0f )
+    {
+        Command command = { COMMAND_PLAY, sound, gain };
+        if ( sound < 0 || ! running.load ( std::memory_order_relaxed ) || ! commands.push ( command ) )
+            dropped++;
+    }
+
+    void stopAll ( )
+    {
+        Command command = { COMMAND_STOP_ALL, -1, 0 };
+        if ( ! commands.push ( command ) )
+            dropped++;
+    }
+
+    long droppedCommands ( ) const { return dropped.load ( ); }
+
+private:
+    enum CommandType { COMMAND_PLAY, COMMAND_STOP_ALL };
+
+    struct Command {
+        CommandType type;
+        int sound;
+        float gain;
+    };
+
+    struct Voice {
+        int sound;
+        size_t position;        // next frame to mix
+        int gain;               // 1 / 256 steps
+    };
+
+    void mix ( )
+    {
+        std::vector < int32_t > accumulator ( period * channels );
+        std::vector < int16_t > out ( period * channels );
+        std::vector < Voice > voices;
+        std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now ( );
+        std::chrono::nanoseconds duration ( ( long long ) period * 1000000000LL / rate );
+
+        while ( running.load ( ) ) {
+            Command command;
+            while ( commands.pop ( command ) ) {
+                if ( command.type == COMMAND_STOP_ALL ) {
+                    voices.clear ( );
+                    continue;
+                }
+                if ( command.sound >= ( int ) sounds.size ( ) )
+                    continue;
+                // out of voices : the oldest one makes room
+                if ( ( int ) voices.size ( ) == max_voices )
+                    voices.erase ( voices.begin ( ) );
+                Voice voice = { command.sound, 0, ( int ) ( command.gain * 256 ) };
+                voices.push_back ( voice );
+            }
+
+            std::fill ( accumulator.begin ( ), accumulator.end ( ), 0 );
+            for ( size_t v = 0; v < voices.size ( ); ) {
+                if ( add ( voices[ v ], accumulator ) )
+                    v++;
+                else
+                    voices.erase ( voices.begin ( ) + v );
+            }
+            for ( size_t i = 0; i < accumulator.size ( ); i++ )
+                out[ i ] = ( int16_t ) std::max ( -32768, std::min ( 32767, accumulator[ i ] ) );
+
+            sink->write ( &out[0], period );
+            if ( ! sink->blocking ( ) ) {
+                next += duration;
+                std::this_thread::sleep_until ( next );
+            }
+        }
+    }
+
+    /* Mix the next period of a voice, false once it has finished */
+    bool add ( Voice &voice, std::vector < int32_t > &accumulator )
+    {
+        const Sound &sound = sounds[ voice.sound ];
+        size_t frames = sound.frames ( );
+        for ( size_t f = 0; f < period && voice.position < frames; f++, voice.position++ ) {
+            for ( int c = 0; c < channels; c++ ) {
+                // mono sources feed every channel, extra source channels are dropped
+                int16_t sample = sound.samples[ voice.position * sound.channels + ( c < sound.channels ? c : 0 ) ];
+                accumulator[ f * channels + c ] += sample * voice.gain >> 8;
+            }
+        }
+        return voice.position < frames;
+    }
+
+    std::vector < Sound > sounds;
+    std::unique_ptr < Sink > sink;
+    int rate;
+    int channels;
+
+    std::atomic < bool > running;
+    std::atomic < long > dropped;
+    SpscQueue < Command, 64 > commands;
+    std::thread mixer;
+};
+
+}
+
+#endif
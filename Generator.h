@@ -0,0 +1,208 @@
+#ifndef BLOXORZ_GENERATOR_H
+#define BLOXORZ_GENERATOR_H
+
+// Procedural levels : random candidates carved on a grid, solved on worker
+// threads and kept when their shortest solution falls in a difficulty band.
+//
+// Candidates are numbered and candidate i is always built from the same
+// generator state, so for a given seed and options the levels kept are the
+// same whatever the number of threads : the accepted candidates are sorted
+// by number and the lowest ones returned.
+
+#include "Simulation.h"
+#include "Solver.h"
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+
+namespace sim {
+
+struct GeneratorOptions {
+    int rows;
+    int cols;
+    double density;         // share of the grid carved into floor
+    double fragile;         // chance of a floor tile being fragile
+    int switches;           // switch and bridge pairs per level
+    int minMoves;           // difficulty band on the shortest solution
+    int maxMoves;
+    int minBranching;       // widest BFS layer, rejects single corridor levels
+    long maxCandidates;     // give up after this many, for bands that cannot be met
+
+    GeneratorOptions ( ) : rows ( 10 ), cols ( 15 ), density ( 0.45 ), fragile ( 0.08 ), switches ( 1 ),
+                           minMoves ( 12 ), maxMoves ( 30 ), minBranching ( 4 ), maxCandidates ( 1000000 ) { }
+};
+
+struct GeneratedLevel {
+    Level level;
+    long candidate;
+    int moves;
+    int branching;
+};
+
+struct GeneratorStats {
+    long candidates;        // built and solved
+    long solvable;
+    long accepted;
+    double seconds;
+};
+
+/* Scramble a candidate number into an independent generator seed ( splitmix64 ) */
+inline uint64_t candidateSeed ( uint64_t seed, uint64_t candidate )
+{
+    uint64_t z = seed + ( candidate + 1 ) * 0x9E3779B97F4A7C15ull;
+    z = ( z ^ ( z >> 30 ) ) * 0xBF58476D1CE4E5B9ull;
+    z = ( z ^ ( z >> 27 ) ) * 0x94D049BB133111EBull;
+    return z ^ ( z >> 31 );
+}
+
+/* Random cell of the given tile kind, -1 when there is none */
+inline int randomCell ( const Level &level, int tile, Random &random )
+{
+    std::vector < int > cells;
+    level.forEachTile ( [ & ] ( int r, int c, int t ) {
+        if ( t == tile )
+            cells.push_back ( r * level.cols + c );
+    } );
+    return cells.empty ( ) ? -1 : cells[ random.below ( cells.size ( ) ) ];
+}
+
+/* A candidate level : floor carved by a random walk of 2x2 brushes, the goal at the floor cell
+   furthest from the start, fragile tiles sprinkled over the rest and each bridge two floor
+   cells in a row, raised until its switch elsewhere on the floor is pressed */
+inline Level randomLevel ( const GeneratorOptions &options, Random &random )
+{
+    Level level;
+    level.resize ( options.rows, options.cols );
+    int rows = options.rows, cols = options.cols;
+
+    int target = rows * cols * options.density, floor = 0;
+    int r = random.below ( rows - 1 ), c = random.below ( cols - 1 );
+    level.startRow = r;
+    level.startCol = c;
+    for ( int step = 0; floor < target && step < 16 * rows * cols; step++ ) {
+        for ( int k = 0; k < 4; k++ ) {
+            floor += level.tile ( r + k / 2, c + k % 2 ) == TILE_EMPTY;
+            level.setTile ( r + k / 2, c + k % 2, TILE_FLOOR );
+        }
+        switch ( random.below ( 4 ) ) {
+            case 0: r = std::max ( r - 1, 0 ); break;
+            case 1: r = std::min ( r + 1, rows - 2 ); break;
+            case 2: c = std::max ( c - 1, 0 ); break;
+            default: c = std::min ( c + 1, cols - 2 ); break;
+        }
+    }
+
+    int start = level.startRow * cols + level.startCol, goal = start, far = -1;
+    level.forEachTile ( [ & ] ( int r, int c, int t ) {
+        int distance = abs ( r - level.startRow ) + abs ( c - level.startCol );
+        if ( t == TILE_FLOOR && distance > far ) {
+            far = distance;
+            goal = r * cols + c;
+        }
+    } );
+    level.setTile ( goal / cols, goal % cols, TILE_GOAL );
+
+    std::vector < int > fragile;
+    level.forEachTile ( [ & ] ( int r, int c, int t ) {
+        if ( t == TILE_FLOOR && r * cols + c != start && random.next ( ) % 1000 < options.fragile * 1000 )
+            fragile.push_back ( r * cols + c );
+    } );
+    for ( size_t f = 0; f < fragile.size ( ); f++ )
+        level.setTile ( fragile[ f ] / cols, fragile[ f ] % cols, TILE_FRAGILE );
+
+    for ( int g = 0; g < options.switches && g < max_bridges; g++ ) {
+        int cell = randomCell ( level, TILE_FLOOR, random );
+        int across = random.below ( 2 ) ? 1 : cols;
+        int r = cell / cols, c = cell % cols, r2 = ( cell + across ) / cols, c2 = ( cell + across ) % cols;
+        if ( cell < 0 || cell == start || cell + across >= rows * cols || ( across == 1 && c == cols - 1 ) ||
+             level.tile ( r2, c2 ) != TILE_FLOOR || cell + across == start )
+            continue;
+        level.setTile ( r, c, TILE_BRIDGE );
+        level.setTile ( r2, c2, TILE_BRIDGE );
+        level.setGroup ( r, c, g );
+        level.setGroup ( r2, c2, g );
+
+        int press = randomCell ( level, TILE_FLOOR, random );
+        if ( press < 0 || press == start ) {
+            level.setTile ( r, c, TILE_FLOOR );
+            level.setTile ( r2, c2, TILE_FLOOR );
+            level.setGroup ( r, c, -1 );
+            level.setGroup ( r2, c2, -1 );
+            continue;
+        }
+        level.setTile ( press / cols, press % cols, TILE_SWITCH );
+        level.setGroup ( press / cols, press % cols, g );
+        level.bridges = g + 1;
+    }
+
+    level.build ( );
+    return level;
+}
+
+/* Build and solve candidates on threads workers until count levels in the band are found
+   or options.maxCandidates were tried; the levels come back in candidate order */
+inline std::vector < GeneratedLevel > generateLevels ( const GeneratorOptions &options, int count, int threads, uint64_t seed, GeneratorStats &stats )
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ( );
+    if ( threads < 1 )
+        threads = std::max ( 1u, std::thread::hardware_concurrency ( ) );
+
+    std::atomic < long > next ( 0 ), solvable ( 0 ), accepted ( 0 );
+    std::mutex lock;
+    std::vector < GeneratedLevel > found;
+
+    std::vector < std::thread > pool;
+    for ( int w = 0; w < threads; w++ ) {
+        pool.push_back ( std::thread ( [ & ] ( ) {
+            for ( ;; ) {
+                if ( accepted.load ( ) >= count )
+                    return;
+                long candidate = next.fetch_add ( 1 );
+                if ( candidate >= options.maxCandidates )
+                    return;
+
+                Random random ( candidateSeed ( seed, candidate ) );
+                GeneratedLevel generated;
+                generated.level = randomLevel ( options, random );
+                generated.candidate = candidate;
+
+                // one thread per candidate : the workers already keep every core busy
+                Solution solution = Solver ( generated.level, 1 ).solve ( );
+                if ( ! solution.solved )
+                    continue;
+                solvable++;
+                generated.moves = solution.moves.size ( );
+                generated.branching = solution.branching;
+                if ( generated.moves < options.minMoves || generated.moves > options.maxMoves || generated.branching < options.minBranching )
+                    continue;
+
+                std::lock_guard < std::mutex > hold ( lock );
+                found.push_back ( generated );
+                accepted++;
+            }
+        } ) );
+    }
+    for ( size_t w = 0; w < pool.size ( ); w++ )
+        pool[ w ].join ( );
+
+    // every candidate below the last one claimed was finished, so the lowest count are
+    // the same whichever thread found them
+    std::sort ( found.begin ( ), found.end ( ), [ ] ( const GeneratedLevel &a, const GeneratedLevel &b ) { return a.candidate < b.candidate; } );
+    if ( ( int ) found.size ( ) > count )
+        found.resize ( count );
+
+    stats.candidates = std::min ( next.load ( ), options.maxCandidates );
+    stats.solvable = solvable.load ( );
+    stats.accepted = found.size ( );
+    stats.seconds = std::chrono::duration < double > ( std::chrono::steady_clock::now ( ) - start ).count ( );
+    return found;
+}
+
+}
+
+#endif
@@ -0,0 +1,545 @@
+#ifndef BLOXORZ_LEVELPACK_H
+#define BLOXORZ_LEVELPACK_H
+
+// Level packs, in a readable text form and a compact binary form.
+//
+// Text form, one block per level :
+//
+//     # comment
+//     level <name>
+//     start <row> <col>
+//     switch <row> <col> [ toggle | on | off ] bridge <row> <col> [ <row> <col> ... ]
+//     map
+//     ###~~G
+//     ...
+//     end
+//
+// Map characters : '.' empty, '#' floor, 'G' goal, '~' fragile, 'S' switch,
+// '=' bridge.  Each switch line binds the switch at ( row, col ) to the
+// listed bridge cells; it toggles them unless it is an on switch, which only
+// lowers them, or an off switch, which only raises them.  A switch line naming
+// the bridges of an earlier one works the same bridges.
+//
+// Binary form, little endian :
+//
+//     "BLXP" u32 version  u32 count  u32 reserved
+//     u64 offset [ count + 1 ]                 level i spans offset [ i ] .. offset [ i + 1 ]
+//     per level : u32 rows  u32 cols  i32 startRow  i32 startCol  u32 nameLength  name
+//                 u32 chunkCount
+//     per chunk : u32 chunkRow  u32 chunkCol   chunk_size square from ( chunkRow, chunkCol ) * chunk_size
+//                 u8 height  u8 width          extent of its tiles from that corner
+//                 u8 tiles [ height * width ]  Tile values, switches of every kind included
+//                 u16 group [ ]                one per switch or bridge cell, row major
+//
+// Only chunks holding a tile are stored, so a level costs space and decoding
+// time in proportion to its tiles rather than its bounding box, and a small
+// level no more than its own area.  Version 1
+// packs, with u8 tiles [ rows * cols ] and one u8 group per switch or bridge
+// cell after the name, are still read.
+//
+// Packs are memory mapped and a level is only decoded when it is asked for,
+// so opening a binary pack costs the same whatever the number of levels.
+
+#include "Simulation.h"
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace sim {
+
+static const char pack_magic [ 4 ] = { 'B', 'L', 'X', 'P' };
+static const uint32_t pack_version = 2;
+
+// Largest row or column count a pack may hold, which keeps every block position in 32 bits
+static const int max_level_side = 1 << 14;
+
+/* Map character of a tile, and back */
+inline char tileChar ( int tile )
+{
+    switch ( tile ) {
+        case TILE_FLOOR: return '#';
+        case TILE_GOAL: return 'G';
+        case TILE_FRAGILE: return '~';
+        case TILE_SWITCH:
+        case TILE_SWITCH_ON:
+        case TILE_SWITCH_OFF: return 'S';
+        case TILE_BRIDGE: return '=';
+        default: return '.';
+    }
+}
+
+inline int charTile ( char c )
+{
+    switch ( c ) {
+        case '#': return TILE_FLOOR;
+        case 'G': return TILE_GOAL;
+        case '~': return TILE_FRAGILE;
+        case 'S': return TILE_SWITCH;
+        case '=': return TILE_BRIDGE;
+        default: return TILE_EMPTY;
+    }
+}
+
+/* Decode one text level from [ begin, end ), which starts at its "level" line */
+inline bool parseTextLevel ( const char *begin, const char *end, Level &level, std::string &name, std::string &error )
+{
+    std::istringstream in ( std::string ( begin, end ) );
+    std::string line;
+    std::vector < std::string > map;
+    std::vector < std::vector < int > > bindings;
+    int startRow = 0, startCol = 0;
+    bool inMap = false;
+
+    while ( std::getline ( in, line ) ) {
+        if ( ! line.empty ( ) && line[ line.size ( ) - 1 ] == '\r' )
+            line.erase ( line.size ( ) - 1 );
+        if ( inMap ) {
+            if ( line == "end" )
+                break;
+            map.push_back ( line );
+            continue;
+        }
+        if ( line.empty ( ) || line[ 0 ] == '#' )
+            continue;
+
+        std::istringstream words ( line );
+        std::string key;
+        words >> key;
+        if ( key == "level" ) {
+            std::getline ( words >> std::ws, name );
+        }
+        else if ( key == "start" ) {
+            words >> startRow >> startCol;
+        }
+        else if ( key == "switch" ) {
+            std::vector < int > binding;
+            std::string word;
+            int r, c, kind = TILE_SWITCH;
+            if ( words >> r >> c >> word && ( word == "toggle" || word == "on" || word == "off" ) ) {
+                kind = word == "on" ? TILE_SWITCH_ON : word == "off" ? TILE_SWITCH_OFF : TILE_SWITCH;
+                words >> word;
+            }
+            if ( ! words || word != "bridge" ) {
+                error = "bad switch line : " + line;
+                return false;
+            }
+            // the switch cell and its kind, then its bridge cells
+            binding.push_back ( r );
+            binding.push_back ( c );
+            binding.push_back ( kind );
+            while ( words >> r >> c ) {
+                binding.push_back ( r );
+                binding.push_back ( c );
+            }
+            bindings.push_back ( binding );
+        }
+        else if ( key == "map" ) {
+            inMap = true;
+        }
+        else if ( key == "end" ) {
+            break;
+        }
+        else {
+            error = "unknown keyword : " + key;
+            return false;
+        }
+    }
+
+    size_t cols = 0;
+    for ( size_t r = 0; r < map.size ( ); r++ )
+        cols = std::max ( cols, map[ r ].size ( ) );
+    if ( map.empty ( ) || cols == 0 ) {
+        error = "level " + name + " has no map";
+        return false;
+    }
+    if ( map.size ( ) > ( size_t ) max_level_side || cols > ( size_t ) max_level_side ) {
+        error = "level " + name + " is too large";
+        return false;
+    }
+
+    level = Level ( );
+    level.resize ( map.size ( ), cols );
+    level.startRow = startRow;
+    level.startCol = startCol;
+    if ( ! level.inside ( startRow, startCol ) ) {
+        error = "start outside the map in level " + name;
+        return false;
+    }
+    for ( size_t r = 0; r < map.size ( ); r++ ) {
+        for ( size_t c = 0; c < map[ r ].size ( ); c++ ) {
+            int t = charTile ( map[ r ][ c ] );
+            // switches and bridges only exist through a switch line
+            if ( t != TILE_EMPTY && t != TILE_SWITCH && t != TILE_BRIDGE )
+                level.setTile ( r, c, t );
+        }
+    }
+
+    for ( size_t b = 0; b < bindings.size ( ); b++ ) {
+        // a switch line naming the bridges of an earlier one joins its group
+        const std::vector < int > &binding = bindings[ b ];
+        int group = binding.size ( ) > 4 && level.tile ( binding[ 3 ], binding[ 4 ] ) == TILE_BRIDGE ? level.groupAt ( binding[ 3 ], binding[ 4 ] ) : -1;
+        if ( group < 0 ) {
+            if ( level.bridges >= max_bridges ) {
+                error = "too many switches in level " + name;
+                return false;
+            }
+            group = level.bridges++;
+        }
+        for ( size_t k = 0; k + 1 < binding.size ( ); k += k == 0 ? 3 : 2 ) {
+            int r = binding[ k ], c = binding[ k + 1 ];
+            if ( ! level.inside ( r, c ) ) {
+                error = "switch or bridge outside the map in level " + name;
+                return false;
+            }
+            if ( k > 0 && level.tile ( r, c ) == TILE_BRIDGE && level.groupAt ( r, c ) != group ) {
+                error = "bridge cell of two switch groups in level " + name;
+                return false;
+            }
+            level.setTile ( r, c, k == 0 ? binding[ 2 ] : TILE_BRIDGE );
+            level.setGroup ( r, c, group );
+        }
+    }
+
+    level.build ( );
+    return true;
+}
+
+/* Text block of a level, the inverse of parseTextLevel */
+inline std::string formatTextLevel ( const Level &level, const std::string &name )
+{
+    std::ostringstream out;
+    out << "level " << name << "\n";
+    out << "start " << level.startRow << " " << level.startCol << "\n";
+
+    // one pass over the tiles collects the switches and the map; a group's switches after the
+    // first name the same bridges, which makes them join it when read back
+    std::vector < std::vector < int > > switches ( level.bridges );
+    std::vector < std::string > map ( level.rows );
+    level.forEachTile ( [ & ] ( int r, int c, int t ) {
+        std::string &row = map[ r ];
+        if ( ( int ) row.size ( ) <= c )
+            row.resize ( c + 1, '.' );
+        row[ c ] = tileChar ( t );
+        int g = level.groupAt ( r, c );
+        if ( switchTile ( t ) && g >= 0 && g < level.bridges ) {
+            switches[ g ].push_back ( r );
+            switches[ g ].push_back ( c );
+            switches[ g ].push_back ( t );
+        }
+    } );
+
+    static const char *kinds [ ] = { "", " on", " off" };
+    for ( int g = 0; g < level.bridges; g++ ) {
+        for ( size_t k = 0; k < switches[ g ].size ( ); k += 3 ) {
+            out << "switch " << switches[ g ][ k ] << " " << switches[ g ][ k + 1 ] << kinds[ switches[ g ][ k + 2 ] - TILE_SWITCH ] << " bridge";
+            for ( uint32_t b = level.bridgeStart[ g ]; b < level.bridgeStart[ g + 1 ]; b++ )
+                out << " " << level.bridgeCells[ b ] / level.cols << " " << level.bridgeCells[ b ] % level.cols;
+            out << "\n";
+        }
+    }
+
+    out << "map\n";
+    for ( int r = 0; r < level.rows; r++ )
+        out << map[ r ] << "\n";
+    out << "end\n";
+    return out.str ( );
+}
+
+/* Binary record of a level, in the current version */
+inline void encodeBinaryLevel ( const Level &level, const std::string &name, std::vector < char > &out )
+{
+    uint32_t header [ 6 ] = { ( uint32_t ) level.rows, ( uint32_t ) level.cols, ( uint32_t ) level.startRow,
+                              ( uint32_t ) level.startCol, ( uint32_t ) name.size ( ), ( uint32_t ) level.chunkCount ( ) };
+    out.insert ( out.end ( ), ( const char * ) header, ( const char * ) header + 5 * sizeof ( uint32_t ) );
+    out.insert ( out.end ( ), name.begin ( ), name.end ( ) );
+    out.insert ( out.end ( ), ( const char * ) ( header + 5 ), ( const char * ) ( header + 6 ) );
+
+    const Bitboard &board = level.board;
+    for ( size_t s = 0; s < board.directory.size ( ); s++ ) {
+        if ( ! board.occupied ( s ) )
+            continue;
+        const Bitboard::Chunk &k = *board.directory[ s ];
+        uint32_t position [ 2 ] = { ( uint32_t ) ( s / board.stride - 1 ), ( uint32_t ) ( s % board.stride - 1 ) };
+        unsigned char extent [ 2 ] = { 0, 0 };
+        for ( int i = Bitboard::nextTile ( k, 0 ); i < chunk_size * chunk_size; i = Bitboard::nextTile ( k, i + 1 ) ) {
+            extent[ 0 ] = std::max ( extent[ 0 ], ( unsigned char ) ( ( i >> chunk_shift ) + 1 ) );
+            extent[ 1 ] = std::max ( extent[ 1 ], ( unsigned char ) ( ( i & chunk_mask ) + 1 ) );
+        }
+        out.insert ( out.end ( ), ( const char * ) position, ( const char * ) position + sizeof ( position ) );
+        out.insert ( out.end ( ), extent, extent + 2 );
+        for ( int r = 0; r < extent[ 0 ]; r++ )
+            out.insert ( out.end ( ), k.tiles + ( r << chunk_shift ), k.tiles + ( r << chunk_shift ) + extent[ 1 ] );
+        for ( int r = 0; r < extent[ 0 ]; r++ ) {
+            for ( int c = 0; c < extent[ 1 ]; c++ ) {
+                int i = r << chunk_shift | c;
+                if ( switchTile ( k.tiles[ i ] ) || k.tiles[ i ] == TILE_BRIDGE )
+                    out.insert ( out.end ( ), ( const char * ) &k.groups[ i ], ( const char * ) &k.groups[ i ] + 2 );
+            }
+        }
+    }
+}
+
+/* Set the tile of cell r, c from a binary record, reading the group of a switch or bridge
+   cell at p, width bytes wide; false when the tile is unknown or the group missing or out of range */
+inline bool decodeCell ( Level &level, int r, int c, int t, const char *&p, const char *end, int width )
+{
+    if ( t > TILE_BRIDGE )
+        return false;
+    level.setTile ( r, c, t );
+    if ( ! switchTile ( t ) && t != TILE_BRIDGE )
+        return true;
+    uint16_t group = 0;
+    if ( p + width > end )
+        return false;
+    memcpy ( &group, p, width );
+    p += width;
+    if ( group >= max_bridges )
+        return false;
+    level.setGroup ( r, c, group );
+    level.bridges = std::max ( level.bridges, group + 1 );
+    return true;
+}
+
+inline bool decodeBinaryLevel ( const char *data, size_t size, uint32_t version, Level &level, std::string &name, std::string &error )
+{
+    uint32_t header [ 5 ];
+    if ( size < sizeof ( header ) ) {
+        error = "truncated level record";
+        return false;
+    }
+    memcpy ( header, data, sizeof ( header ) );
+    uint64_t rows = header[ 0 ], cols = header[ 1 ], nameLength = header[ 4 ];
+    const char *p = data + sizeof ( header ), *end = data + size;
+    if ( nameLength > size - sizeof ( header ) ) {
+        error = "truncated level record";
+        return false;
+    }
+    name.assign ( p, nameLength );
+    p += nameLength;
+
+    level = Level ( );
+    if ( rows == 0 || cols == 0 || rows > ( uint64_t ) max_level_side || cols > ( uint64_t ) max_level_side ) {
+        error = "bad size of level " + name;
+        return false;
+    }
+    level.resize ( rows, cols );
+    level.startRow = ( int32_t ) header[ 2 ];
+    level.startCol = ( int32_t ) header[ 3 ];
+    if ( ! level.inside ( level.startRow, level.startCol ) ) {
+        error = "start outside the map in level " + name;
+        return false;
+    }
+
+    if ( version == 1 ) {
+        if ( ( uint64_t ) ( end - p ) < rows * cols ) {
+            error = "truncated level record";
+            return false;
+        }
+        const char *tiles = p;
+        p += rows * cols;
+        for ( uint64_t i = 0; i < rows * cols; i++ ) {
+            if ( ! decodeCell ( level, i / cols, i % cols, ( unsigned char ) tiles[ i ], p, end, 1 ) ) {
+                error = "bad tile or bridge group in level " + name;
+                return false;
+            }
+        }
+        level.build ( );
+        return true;
+    }
+
+    uint32_t chunkCount;
+    if ( end - p < 4 ) {
+        error = "truncated level record";
+        return false;
+    }
+    memcpy ( &chunkCount, p, 4 );
+    p += 4;
+    for ( uint32_t n = 0; n < chunkCount; n++ ) {
+        uint32_t position [ 2 ];
+        unsigned char extent [ 2 ];
+        if ( ( size_t ) ( end - p ) < sizeof ( position ) + sizeof ( extent ) ) {
+            error = "truncated level record";
+            return false;
+        }
+        memcpy ( position, p, sizeof ( position ) );
+        memcpy ( extent, p + sizeof ( position ), sizeof ( extent ) );
+        const char *tiles = p + sizeof ( position ) + sizeof ( extent );
+        if ( extent[ 0 ] > chunk_size || extent[ 1 ] > chunk_size || end - tiles < extent[ 0 ] * extent[ 1 ] ) {
+            error = "bad chunk in level " + name;
+            return false;
+        }
+        p = tiles + extent[ 0 ] * extent[ 1 ];
+        for ( int i = 0; i < extent[ 0 ] * extent[ 1 ]; i++ ) {
+            int r = ( position[ 0 ] << chunk_shift ) + i / extent[ 1 ], c = ( position[ 1 ] << chunk_shift ) + i % extent[ 1 ];
+            int t = ( unsigned char ) tiles[ i ];
+            if ( t == TILE_EMPTY )
+                continue;
+            if ( ! level.inside ( r, c ) ) {
+                error = "tile outside the map in level " + name;
+                return false;
+            }
+            if ( ! decodeCell ( level, r, c, t, p, end, 2 ) ) {
+                error = "bad tile or bridge group in level " + name;
+                return false;
+            }
+        }
+    }
+
+    level.build ( );
+    return true;
+}
+
+/* Write levels as a binary pack */
+inline bool writeBinaryPack ( const char *path, const std::vector < Level > &levels, const std::vector < std::string > &names )
+{
+    std::vector < char > body;
+    std::vector < uint64_t > offsets;
+    uint64_t base = 16 + 8 * ( levels.size ( ) + 1 );
+    for ( size_t i = 0; i < levels.size ( ); i++ ) {
+        offsets.push_back ( base + body.size ( ) );
+        encodeBinaryLevel ( levels[ i ], names[ i ], body );
+    }
+    offsets.push_back ( base + body.size ( ) );
+
+    FILE *file = fopen ( path, "wb" );
+    if ( ! file )
+        return false;
+    uint32_t header [ 3 ] = { pack_version, ( uint32_t ) levels.size ( ), 0 };
+    fwrite ( pack_magic, 1, 4, file );
+    fwrite ( header, sizeof ( header ), 1, file );
+    fwrite ( &offsets[0], sizeof ( uint64_t ), offsets.size ( ), file );
+    if ( ! body.empty ( ) )
+        fwrite ( &body[0], 1, body.size ( ), file );
+    return fclose ( file ) == 0;
+}
+
+/* A memory mapped pack, text or binary, decoded one level at a time */
+class LevelPack {
+public:
+    LevelPack ( ) : data ( NULL ), size ( 0 ), binary ( false ), version ( 0 ), levels ( 0 ), scanned ( 0 ) { }
+    ~LevelPack ( ) { close ( ); }
+
+    bool open ( const char *path )
+    {
+        close ( );
+        int fd = ::open ( path, O_RDONLY );
+        if ( fd < 0 ) {
+            error = std::string ( "cannot open " ) + path;
+            return false;
+        }
+        struct stat info;
+        if ( fstat ( fd, &info ) != 0 || info.st_size == 0 ) {
+            ::close ( fd );
+            error = std::string ( "empty level pack " ) + path;
+            return false;
+        }
+        void *mapping = mmap ( NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        ::close ( fd );
+        if ( mapping == MAP_FAILED ) {
+            error = std::string ( "cannot map " ) + path;
+            return false;
+        }
+        data = ( const char * ) mapping;
+        size = info.st_size;
+
+        binary = size >= 16 && memcmp ( data, pack_magic, 4 ) == 0;
+        if ( binary ) {
+            uint32_t header [ 3 ];
+            memcpy ( header, data + 4, sizeof ( header ) );
+            levels = header[ 1 ];
+            version = header[ 0 ];
+            if ( version < 1 || version > pack_version || 16 + 8 * ( ( uint64_t ) levels + 1 ) > size ) {
+                error = std::string ( "unsupported level pack " ) + path;
+                close ( );
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void close ( )
+    {
+        if ( data )
+            munmap ( ( void * ) data, size );
+        data = NULL;
+        size = 0;
+        levels = 0;
+        scanned = 0;
+        starts.clear ( );
+    }
+
+    /* Number of levels; a text pack is scanned to its end the first time */
+    int count ( )
+    {
+        if ( binary )
+            return levels;
+        while ( scanNext ( ) )
+            ;
+        return starts.size ( );
+    }
+
+    /* Decode level index, false past the last level or on a malformed level */
+    bool load ( int index, Level &level, std::string &name )
+    {
+        if ( ! data || index < 0 )
+            return false;
+
+        if ( binary ) {
+            if ( ( uint32_t ) index >= levels )
+                return false;
+            uint64_t span [ 2 ];
+            memcpy ( span, data + 16 + 8 * index, sizeof ( span ) );
+            if ( span[ 0 ] > span[ 1 ] || span[ 1 ] > size ) {
+                error = "bad offset table";
+                return false;
+            }
+            return decodeBinaryLevel ( data + span[ 0 ], span[ 1 ] - span[ 0 ], version, level, name, error );
+        }
+
+        while ( ( int ) starts.size ( ) <= index + 1 && scanNext ( ) )
+            ;
+        if ( ( int ) starts.size ( ) <= index )
+            return false;
+        size_t end = ( int ) starts.size ( ) > index + 1 ? starts[ index + 1 ] : size;
+        return parseTextLevel ( data + starts[ index ], data + end, level, name, error );
+    }
+
+    bool isBinary ( ) const { return binary; }
+
+    std::string error;
+
+private:
+    /* Advance the text scan to the next "level" line, false at the end of the file */
+    bool scanNext ( )
+    {
+        while ( scanned < size ) {
+            size_t line = scanned;
+            const char *eol = ( const char * ) memchr ( data + line, '\n', size - line );
+            scanned = eol ? eol - data + 1 : size;
+            if ( scanned - line >= 6 && memcmp ( data + line, "level", 5 ) == 0 && ( data[ line + 5 ] == ' ' || data[ line + 5 ] == '\t' ) ) {
+                starts.push_back ( line );
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const char *data;
+    size_t size;
+    bool binary;
+    uint32_t version;       // of a binary pack
+    uint32_t levels;
+    size_t scanned;
+    std::vector < size_t > starts;      // offsets of the text levels found so far
+};
+
+}
+
+#endif
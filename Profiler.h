@@ -0,0 +1,208 @@
+#ifndef BLOXORZ_PROFILER_H
+#define BLOXORZ_PROFILER_H
+
+// Per frame timings of the phases of the game loop and counts of GL work,
+// summarised as min / avg / p99 / max and written as CSV or JSON so runs can
+// be compared.  CPU times are taken here; GPU times are measured by the
+// renderer and handed in once their queries complete.
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+namespace prof {
+
+enum Phase {
+    PHASE_UPDATE,       // every fixed tick run this frame
+    PHASE_ROLL,         // block roll, inside the ticks
+    PHASE_CHECK,        // fall and goal checks, inside the ticks
+    PHASE_VIEWER,       // camera
+    PHASE_HUD,          // level, time and moves counters
+    PHASE_BOARD,        // tiles
+    PHASE_BLOCK,        // block matrices and draw
+    PHASE_SUBMIT,       // sorting and drawing what the phases above queued; its GPU time is every draw
+    PHASE_SWAP,         // buffer swap, including any wait for vsync
+    PHASE_FRAME,        // the whole frame
+    phase_count
+};
+
+enum Counter {
+    COUNTER_DRAWS,      // draw calls
+    COUNTER_UNIFORMS,   // uniform uploads
+    COUNTER_OBJECTS,    // vertex arrays and buffers created
+    COUNTER_MATRICES,   // world and MVP matrices rebuilt
+    COUNTER_CULLED,     // tiles outside the view frustum, not submitted
+    COUNTER_STATE_CALLS,    // state changes passed on to GL
+    COUNTER_STATE_SKIPPED,  // state changes dropped as redundant
+    COUNTER_UPLOADED,   // bytes written into existing buffers
+    counter_count
+};
+
+static const char *phase_names [ phase_count ] = {
+    "update", "roll", "check", "viewer", "hud", "board", "block", "submit", "swap", "frame"
+};
+
+static const char *counter_names [ counter_count ] = {
+    "draws", "uniforms", "objects", "matrices", "culled", "state_calls", "state_skipped", "uploaded"
+};
+
+struct Statistics {
+    double min;
+    double avg;
+    double p99;
+    double max;
+};
+
+inline Statistics summarise ( std::vector < double > samples )
+{
+    Statistics s = { 0, 0, 0, 0 };
+    if ( samples.empty ( ) )
+        return s;
+    std::sort ( samples.begin ( ), samples.end ( ) );
+    double sum = 0;
+    for ( size_t i = 0; i < samples.size ( ); i++ )
+        sum += samples[ i ];
+    size_t p99 = ( samples.size ( ) * 99 + 99 ) / 100;
+    s.min = samples.front ( );
+    s.avg = sum / samples.size ( );
+    s.p99 = samples[ std::min ( p99, samples.size ( ) ) - 1 ];
+    s.max = samples.back ( );
+    return s;
+}
+
+class Profiler {
+public:
+    Profiler ( ) : enabled ( false ) { beginFrame ( ); }
+
+    /* Start a new frame; everything timed or counted until endFrame belongs to it */
+    void beginFrame ( )
+    {
+        for ( int p = 0; p < phase_count; p++ )
+            frameCpu[ p ] = 0;
+        for ( int c = 0; c < counter_count; c++ )
+            frameCounts[ c ] = 0;
+    }
+
+    void endFrame ( )
+    {
+        if ( ! enabled )
+            return;
+        for ( int p = 0; p < phase_count; p++ )
+            cpu[ p ].push_back ( frameCpu[ p ] );
+        for ( int c = 0; c < counter_count; c++ )
+            counts[ c ].push_back ( frameCounts[ c ] );
+    }
+
+    /* A phase may run several times in a frame; its times add up */
+    void begin ( Phase phase )
+    {
+        if ( enabled )
+            started[ phase ] = std::chrono::steady_clock::now ( );
+    }
+
+    void end ( Phase phase )
+    {
+        if ( enabled )
+            frameCpu[ phase ] += std::chrono::duration < double, std::milli > ( std::chrono::steady_clock::now ( ) - started[ phase ] ).count ( );
+    }
+
+    void count ( Counter counter, int n = 1 )
+    {
+        frameCounts[ counter ] += n;
+    }
+
+    /* GPU time of a phase in milliseconds, for whichever frame its query came from */
+    void gpuSample ( Phase phase, double ms )
+    {
+        gpu[ phase ].push_back ( ms );
+    }
+
+    /* Fragments that passed the depth test, and so were shaded, in a frame */
+    void fragmentSample ( double fragments )
+    {
+        gpuFragments.push_back ( fragments );
+    }
+
+    int frames ( ) const
+    {
+        return cpu[ PHASE_FRAME ].size ( );
+    }
+
+    bool writeCsv ( const char *path ) const
+    {
+        FILE *file = fopen ( path, "w" );
+        if ( ! file )
+            return false;
+        fprintf ( file, "metric,unit,samples,min,avg,p99,max\n" );
+        std::vector < Row > table = rows ( );
+        for ( size_t r = 0; r < table.size ( ); r++ )
+            fprintf ( file, "%s,%s,%d,%.4f,%.4f,%.4f,%.4f\n", table[ r ].name.c_str ( ), table[ r ].unit,
+                      table[ r ].samples, table[ r ].stats.min, table[ r ].stats.avg, table[ r ].stats.p99, table[ r ].stats.max );
+        return fclose ( file ) == 0;
+    }
+
+    bool writeJson ( const char *path ) const
+    {
+        FILE *file = fopen ( path, "w" );
+        if ( ! file )
+            return false;
+        fprintf ( file, "{\n  \"frames\": %d,\n  \"metrics\": {", frames ( ) );
+        std::vector < Row > table = rows ( );
+        for ( size_t r = 0; r < table.size ( ); r++ )
+            fprintf ( file, "%s\n    \"%s\": { \"unit\": \"%s\", \"samples\": %d, \"min\": %.4f, \"avg\": %.4f, \"p99\": %.4f, \"max\": %.4f }",
+                      r ? "," : "", table[ r ].name.c_str ( ), table[ r ].unit, table[ r ].samples,
+                      table[ r ].stats.min, table[ r ].stats.avg, table[ r ].stats.p99, table[ r ].stats.max );
+        fprintf ( file, "\n  }\n}\n" );
+        return fclose ( file ) == 0;
+    }
+
+    bool enabled;
+
+private:
+    struct Row {
+        std::string name;
+        const char *unit;
+        int samples;
+        Statistics stats;
+    };
+
+    /* cpu.<phase> and gpu.<phase> in milliseconds, gpu.fragments and count.<counter> per frame; phases the GPU
+       never timed are left out */
+    std::vector < Row > rows ( ) const
+    {
+        std::vector < Row > table;
+        for ( int p = 0; p < phase_count; p++ ) {
+            Row row = { std::string ( "cpu." ) + phase_names[ p ], "ms", ( int ) cpu[ p ].size ( ), summarise ( cpu[ p ] ) };
+            table.push_back ( row );
+        }
+        for ( int p = 0; p < phase_count; p++ ) {
+            if ( gpu[ p ].empty ( ) )
+                continue;
+            Row row = { std::string ( "gpu." ) + phase_names[ p ], "ms", ( int ) gpu[ p ].size ( ), summarise ( gpu[ p ] ) };
+            table.push_back ( row );
+        }
+        if ( ! gpuFragments.empty ( ) ) {
+            Row row = { "gpu.fragments", "count", ( int ) gpuFragments.size ( ), summarise ( gpuFragments ) };
+            table.push_back ( row );
+        }
+        for ( int c = 0; c < counter_count; c++ ) {
+            Row row = { std::string ( "count." ) + counter_names[ c ], "count", ( int ) counts[ c ].size ( ), summarise ( counts[ c ] ) };
+            table.push_back ( row );
+        }
+        return table;
+    }
+
+    std::chrono::steady_clock::time_point started [ phase_count ];
+    double frameCpu [ phase_count ];
+    double frameCounts [ counter_count ];
+    std::vector < double > cpu [ phase_count ];
+    std::vector < double > gpu [ phase_count ];
+    std::vector < double > gpuFragments;
+    std::vector < double > counts [ counter_count ];
+};
+
+}
+
+#endif
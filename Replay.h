@@ -0,0 +1,228 @@
+#ifndef BLOXORZ_REPLAY_H
+#define BLOXORZ_REPLAY_H
+
+// Session logs : the seed of the game's random generator and every input,
+// stamped with the tick it was applied before, so a session can be played
+// back exactly, as fast as the CPU allows or in real time.
+//
+// Binary form, little endian :
+//
+//     "BLXR" u32 version  u64 seed
+//     per input : varint ticks since the previous input  u8 input
+//     end :       varint ticks since the last input      u8 0xFF
+//
+// A varint holds 7 bits per byte, low bits first, the top bit set on every
+// byte but the last, so a key press costs two or three bytes.  Inputs are
+// flushed as they happen; a log cut short by a crash replays up to its
+// last input.
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+
+namespace replay {
+
+static const char log_magic [ 4 ] = { 'B', 'L', 'X', 'R' };
+static const uint32_t log_version = 2;     // 2 : start heights drawn per tile, no longer per cell of a 20x20 board
+
+enum Input {
+    INPUT_UP,
+    INPUT_DOWN,
+    INPUT_LEFT,
+    INPUT_RIGHT,
+    INPUT_VIEW,             // next camera
+    INPUT_INSTANCED,        // instanced board on or off
+    INPUT_SPLIT,            // split screen on or off
+    INPUT_PERSPECTIVE,      // perspective on or off
+    input_count
+};
+
+static const unsigned char input_end = 0xFF;
+
+struct Event {
+    uint64_t tick;
+    Input input;
+};
+
+struct Log {
+    uint64_t seed;
+    std::vector < Event > events;
+    uint64_t endTick;       // ticks the session ran for
+};
+
+inline void putVarint ( uint64_t value, std::vector < char > &out )
+{
+    while ( value >= 0x80 ) {
+        out.push_back ( ( char ) ( ( value & 0x7F ) | 0x80 ) );
+        value >>= 7;
+    }
+    out.push_back ( ( char ) value );
+}
+
+/* Read a varint at p, false when it runs past end */
+inline bool getVarint ( const char *&p, const char *end, uint64_t &value )
+{
+    value = 0;
+    for ( int shift = 0; p < end && shift < 64; shift += 7 ) {
+        unsigned char byte = *p++;
+        value |= ( uint64_t ) ( byte & 0x7F ) << shift;
+        if ( ! ( byte & 0x80 ) )
+            return true;
+    }
+    return false;
+}
+
+inline bool decodeLog ( const char *data, size_t size, Log &log, std::string &error )
+{
+    uint32_t version;
+    if ( size < 16 || memcmp ( data, log_magic, 4 ) != 0 ) {
+        error = "not a session log";
+        return false;
+    }
+    memcpy ( &version, data + 4, 4 );
+    if ( version != log_version ) {
+        error = "unsupported session log version";
+        return false;
+    }
+    memcpy ( &log.seed, data + 8, 8 );
+    log.events.clear ( );
+    log.endTick = 0;
+
+    const char *p = data + 16, *end = data + size;
+    uint64_t tick = 0, delta;
+    while ( p < end ) {
+        if ( ! getVarint ( p, end, delta ) || p >= end )
+            break;
+        tick += delta;
+        unsigned char input = *p++;
+        if ( input == input_end ) {
+            log.endTick = tick;
+            return true;
+        }
+        if ( input >= input_count ) {
+            error = "bad input in session log";
+            return false;
+        }
+        Event event = { tick, ( Input ) input };
+        log.events.push_back ( event );
+    }
+    // no end marker : the session stopped abruptly, replay what was written
+    log.endTick = log.events.empty ( ) ? 0 : log.events.back ( ).tick + 1;
+    return true;
+}
+
+inline bool readLog ( const char *path, Log &log, std::string &error )
+{
+    FILE *file = fopen ( path, "rb" );
+    if ( ! file ) {
+        error = std::string ( "cannot open " ) + path;
+        return false;
+    }
+    std::vector < char > data;
+    char buffer [ 4096 ];
+    size_t n;
+    while ( ( n = fread ( buffer, 1, sizeof ( buffer ), file ) ) > 0 )
+        data.insert ( data.end ( ), buffer, buffer + n );
+    fclose ( file );
+    return decodeLog ( data.empty ( ) ? "" : &data[0], data.size ( ), log, error );
+}
+
+/* Writes a log as the session runs */
+class Recorder {
+public:
+    Recorder ( ) : file ( NULL ), last ( 0 ) { }
+    ~Recorder ( ) { close ( last ); }
+
+    bool open ( const char *path, uint64_t seed )
+    {
+        file = fopen ( path, "wb" );
+        if ( ! file ) {
+            error = std::string ( "cannot create " ) + path;
+            return false;
+        }
+        fwrite ( log_magic, 1, 4, file );
+        fwrite ( &log_version, 4, 1, file );
+        fwrite ( &seed, 8, 1, file );
+        last = 0;
+        return fflush ( file ) == 0;
+    }
+
+    bool recording ( ) const { return file != NULL; }
+
+    /* input was applied before tick; ticks only go forward */
+    void record ( uint64_t tick, Input input )
+    {
+        put ( tick, ( unsigned char ) input );
+    }
+
+    /* End the log after endTick ticks */
+    bool close ( uint64_t endTick )
+    {
+        if ( ! file )
+            return true;
+        put ( endTick, input_end );
+        bool ok = fclose ( file ) == 0;
+        file = NULL;
+        return ok;
+    }
+
+    std::string error;
+
+private:
+    void put ( uint64_t tick, unsigned char input )
+    {
+        if ( ! file )
+            return;
+        if ( tick < last )
+            tick = last;
+        std::vector < char > bytes;
+        putVarint ( tick - last, bytes );
+        bytes.push_back ( ( char ) input );
+        last = tick;
+        fwrite ( &bytes[0], 1, bytes.size ( ), file );
+        fflush ( file );
+    }
+
+    FILE *file;
+    uint64_t last;
+};
+
+/* Hands back the inputs of a log as their ticks come up */
+class Player {
+public:
+    Player ( ) : active ( false ), cursor ( 0 ) { }
+
+    bool open ( const char *path )
+    {
+        active = readLog ( path, log, error );
+        cursor = 0;
+        return active;
+    }
+
+    /* The next input due before tick, if any */
+    bool next ( uint64_t tick, Input &input )
+    {
+        if ( ! active || cursor >= log.events.size ( ) || log.events[ cursor ].tick > tick )
+            return false;
+        input = log.events[ cursor++ ].input;
+        return true;
+    }
+
+    bool finished ( uint64_t tick ) const
+    {
+        return active && tick >= log.endTick;
+    }
+
+    bool active;
+    Log log;
+    std::string error;
+
+private:
+    size_t cursor;
+};
+
+}
+
+#endif
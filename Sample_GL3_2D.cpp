@@ -3,155 +3,569 @@
 #include <fstream>
 #include <vector>
 #include <map>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <climits>
+#include <chrono>
+#include <thread>
+#include <memory>
 #include <GL/glew.h>
 #include <GL/gl.h>
 #include <GLFW/glfw3.h>
+#include <sys/stat.h>
+#include <malloc.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include "Simulation.h"
+#include "Solver.h"
+#include "LevelPack.h"
+#include "Profiler.h"
+#include "Audio.h"
+#include "Replay.h"
+#include "Generator.h"
+
 using namespace std;
 
 GLFWwindow* window;
 
+/* Vertex layouts a mesh can be stored in */
+enum VertexFormat {
+    FORMAT_FLOAT,           // separate float position and colour buffers, not indexed
+    FORMAT_INTERLEAVED,     // one buffer of float position + float colour, indexed
+    FORMAT_PACKED           // one buffer of half float position + normalized byte colour, indexed
+};
+
 struct VAO {
     GLuint VertexArrayID;
     GLuint VertexBuffer;
     GLuint ColorBuffer;
+    GLuint InstanceBuffer;
+    GLuint IndexBuffer;
 
     GLenum PrimitiveMode;
     GLenum FillMode;
+    GLenum IndexType;
+    VertexFormat Format;
     int NumVertices;
+    int NumIndices;
+    long Bytes;             // storage of its buffers
+
+    // a VAO owns its vertex array and buffers and deletes them when it goes
+    VAO ( );
+    ~VAO ( );
+
+private:
+    VAO ( const VAO & );
+    VAO &operator= ( const VAO & );
 };
 typedef struct VAO VAO;
+typedef unique_ptr < VAO > MeshHandle;
+
+// Live GL objects and the storage of their buffers and programs : everything created is
+// counted here and taken off again when its handle deletes it, so whatever a level or the
+// HUD leaves behind shows
+struct GPUStats {
+    int vertexArrays;
+    int buffers;
+    int programs;
+    long bytes;
+} gpuStats;
+
+// Phase timings and GL work counts, recorded while benchmarking
+prof::Profiler profiler;
+
+// Last value set for the bits of GL state the renderer changes per draw; every change goes
+// through the functions below, which drop calls that would set what is already there
+struct GLState {
+    GLuint program;
+    GLuint vertexArray;
+    GLuint arrayBuffer;
+    GLenum polygonMode;
+    long issued;
+    long skipped;
+} glState;
+
+/* Count a state call as issued or skipped; true when it has to reach GL */
+bool stateChange ( bool changed )
+{
+    if ( changed ) {
+        glState.issued++;
+        profiler.count ( prof::COUNTER_STATE_CALLS );
+    }
+    else {
+        glState.skipped++;
+        profiler.count ( prof::COUNTER_STATE_SKIPPED );
+    }
+    return changed;
+}
+
+/* Forget the cached state, so the next call of each kind is issued; no object is named ~0 */
+void invalidateGLState ( )
+{
+    glState.program = glState.vertexArray = glState.arrayBuffer = ~0u;
+    glState.polygonMode = GL_NONE;
+}
+
+void useProgram ( GLuint program )
+{
+    if ( stateChange ( glState.program != program ) )
+        glUseProgram ( program );
+    glState.program = program;
+}
+
+void bindVertexArray ( GLuint vertexArray )
+{
+    if ( stateChange ( glState.vertexArray != vertexArray ) )
+        glBindVertexArray ( vertexArray );
+    glState.vertexArray = vertexArray;
+}
+
+void bindArrayBuffer ( GLuint buffer )
+{
+    if ( stateChange ( glState.arrayBuffer != buffer ) )
+        glBindBuffer ( GL_ARRAY_BUFFER, buffer );
+    glState.arrayBuffer = buffer;
+}
+
+void polygonMode ( GLenum mode )
+{
+    if ( stateChange ( glState.polygonMode != mode ) )
+        glPolygonMode ( GL_FRONT_AND_BACK, mode );
+    glState.polygonMode = mode;
+}
+
+VAO::VAO ( ) : VertexArrayID ( 0 ), VertexBuffer ( 0 ), ColorBuffer ( 0 ), InstanceBuffer ( 0 ), IndexBuffer ( 0 ),
+               PrimitiveMode ( GL_TRIANGLES ), FillMode ( GL_FILL ), IndexType ( GL_NONE ), Format ( FORMAT_FLOAT ),
+               NumVertices ( 0 ), NumIndices ( 0 ), Bytes ( 0 ) { }
+
+VAO::~VAO ( )
+{
+    GLuint buffers [ 4 ] = { VertexBuffer, ColorBuffer, InstanceBuffer, IndexBuffer };
+    for ( int b = 0; b < 4; b++ ) {
+        if ( ! buffers[ b ] )
+            continue;
+        glDeleteBuffers ( 1, &buffers[ b ] );
+        gpuStats.buffers -= 1;
+        // deleting what is bound unbinds it
+        if ( glState.arrayBuffer == buffers[ b ] )
+            glState.arrayBuffer = ~0u;
+    }
+    if ( VertexArrayID ) {
+        glDeleteVertexArrays ( 1, &VertexArrayID );
+        gpuStats.vertexArrays -= 1;
+        if ( glState.vertexArray == VertexArrayID )
+            glState.vertexArray = ~0u;
+    }
+    gpuStats.bytes -= Bytes;
+}
+
+void releaseProgram ( GLuint id, long bytes )
+{
+    glDeleteProgram ( id );
+    gpuStats.programs -= 1;
+    gpuStats.bytes -= bytes;
+    if ( glState.program == id )
+        glState.program = ~0u;
+}
+
+void releaseBuffer ( GLuint id, long bytes )
+{
+    glDeleteBuffers ( 1, &id );
+    gpuStats.buffers -= 1;
+    gpuStats.bytes -= bytes;
+    if ( glState.arrayBuffer == id )
+        glState.arrayBuffer = ~0u;
+}
+
+/* Owner of a GL object outside any VAO, a program or a lone buffer of bytes : Release deletes it
+   when the handle is reset or destroyed.  Handles move but never copy, so each object has one owner */
+template < void ( *Release ) ( GLuint, long ) >
+class GLHandle {
+public:
+    explicit GLHandle ( GLuint id = 0, long bytes = 0 ) : id ( id ), bytes ( bytes ) { }
+    GLHandle ( GLHandle &&other ) noexcept : id ( other.id ), bytes ( other.bytes ) { other.id = 0; }
+    GLHandle &operator= ( GLHandle &&other ) noexcept
+    {
+        if ( this != &other ) {
+            reset ( other.id, other.bytes );
+            other.id = 0;
+        }
+        return *this;
+    }
+    ~GLHandle ( ) { reset ( ); }
+
+    void reset ( GLuint next = 0, long nextBytes = 0 )
+    {
+        if ( id )
+            Release ( id, bytes );
+        id = next;
+        bytes = nextBytes;
+    }
+
+    GLuint get ( ) const { return id; }
+
+private:
+    GLHandle ( const GLHandle & );
+    GLHandle &operator= ( const GLHandle & );
+
+    GLuint id;
+    long bytes;
+};
+typedef GLHandle < releaseProgram > ProgramHandle;
+typedef GLHandle < releaseBuffer > BufferHandle;
+
 
 struct GLMatrices {
-    glm::mat4 projectionO, projectionP;
+    glm::mat4 projectionO;
+    GLfloat fov;            // of the perspective views, whose aspect depends on their viewport
     glm::mat4 model;
     glm::mat4 view;
+    glm::mat4 VP;           // projection * view, computed once per frame
+    int VPVersion;          // bumped whenever VP changes
     GLuint MatrixID;
+    GLuint InstancedMatrixID;
 } Matrices;
 
-GLuint programID;
+GLuint programID, instancedProgramID;
+int flatShader, instancedShader;       // their entries in shaderPrograms
+int splitFlatShader = -1, splitInstancedShader = -1;   // split screen variants, where viewport arrays exist
+
+// The programs a scene is drawn with and their uniforms : the plain pair, and the split screen
+// pair that runs the same vertex shaders followed by Sample_GL_Split.geom
+struct ScenePrograms {
+    GLuint flat, instanced;
+    GLint flatMVP, instancedVP;
+    GLint flatViews, instancedViews;            // split pair only
+    GLint flatViewCount, instancedViewCount;
+} scenePrograms [ 2 ];
+
+/* Point programID, instancedProgramID and their matrix handles at one of the pairs */
+void useScenePrograms ( bool split )
+{
+    const ScenePrograms &programs = scenePrograms[ split ];
+    programID = programs.flat;
+    instancedProgramID = programs.instanced;
+    Matrices.MatrixID = programs.flatMVP;
+    Matrices.InstancedMatrixID = programs.instancedVP;
+}
 int proj_type;
 glm::vec3 tri_pos, rect_pos;
 
-/* Function to load Shaders - Use it as it is */
-GLuint LoadShaders ( const char * vertex_file_path,const char * fragment_file_path ) {
+// Shader programs : sources read in one call, linked programs cached on disk as driver
+// binaries keyed by a hash of their sources, compiled in parallel where the driver
+// can, and rebuilt live when a source file changes
+struct ShaderProgram {
+    string vertexPath;
+    string geometryPath;        // empty when the program has no geometry stage
+    string fragmentPath;
+    ProgramHandle id;
+    double vertexTime;
+    double geometryTime;
+    double fragmentTime;
+
+    // while building
+    GLuint building, vertexShader, geometryShader, fragmentShader;
+    uint64_t hash;
+    bool cached;
+};
 
-    // Create the shaders
-    GLuint VertexShaderID = glCreateShader ( GL_VERTEX_SHADER );
-    GLuint FragmentShaderID = glCreateShader ( GL_FRAGMENT_SHADER );
+vector < ShaderProgram > shaderPrograms;
+const char *shader_cache_dir = "shader_cache";
+bool shaderBinaries = false;
 
-    // Read the Vertex Shader code from the file
-    std::string VertexShaderCode;
-    std::ifstream VertexShaderStream( vertex_file_path, std::ios::in );
-    if ( VertexShaderStream.is_open ( ) )
-    {
-       std::string Line = "";
-       while( getline ( VertexShaderStream, Line ) )
-          VertexShaderCode += "\n" + Line;
-      VertexShaderStream.close ( );
-  }
+/* Whole file in one read */
+bool readFile ( const string &path, string &text )
+{
+    ifstream file ( path.c_str ( ), ios::in | ios::binary );
+    if ( ! file )
+        return false;
+    file.seekg ( 0, ios::end );
+    text.resize ( file.tellg ( ) );
+    file.seekg ( 0, ios::beg );
+    if ( ! text.empty ( ) )
+        file.read ( &text[0], text.size ( ) );
+    return file.good ( );
+}
 
-    // Read the Fragment Shader code from the file
-  std::string FragmentShaderCode;
-  std::ifstream FragmentShaderStream ( fragment_file_path, std::ios::in );
-  if ( FragmentShaderStream.is_open ( ) ){
-   std::string Line = "";
-   while ( getline ( FragmentShaderStream, Line ) )
-       FragmentShaderCode += "\n" + Line;
-   FragmentShaderStream.close ( );
-}
-
-GLint Result = GL_FALSE;
-int InfoLogLength;
-
-    // Compile Vertex Shader
-    //    printf("Compiling shader : %s\n", vertex_file_path);
-char const * VertexSourcePointer = VertexShaderCode.c_str();
-glShaderSource ( VertexShaderID, 1, &VertexSourcePointer , NULL );
-glCompileShader ( VertexShaderID );
-
-    // Check Vertex Shader
-glGetShaderiv ( VertexShaderID, GL_COMPILE_STATUS, &Result );
-glGetShaderiv ( VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength );
-std::vector<char> VertexShaderErrorMessage ( InfoLogLength );
-glGetShaderInfoLog ( VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0] );
-    //    fprintf(stdout, "%s\n", &VertexShaderErrorMessage[0]);
-
-    // Compile Fragment Shader
-    //    printf("Compiling shader : %s\n", fragment_file_path);
-char const * FragmentSourcePointer = FragmentShaderCode.c_str ( );
-glShaderSource ( FragmentShaderID, 1, &FragmentSourcePointer , NULL );
-glCompileShader ( FragmentShaderID );
-
-    // Check Fragment Shader
-glGetShaderiv ( FragmentShaderID, GL_COMPILE_STATUS, &Result );
-glGetShaderiv ( FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength );
-std::vector<char> FragmentShaderErrorMessage ( InfoLogLength );
-glGetShaderInfoLog ( FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0] );
-    //    fprintf(stdout, "%s\n", &FragmentShaderErrorMessage[0]);
-
-    // Link the program
-    //    fprintf(stdout, "Linking program\n");
-GLuint ProgramID = glCreateProgram ( );
-glAttachShader ( ProgramID, VertexShaderID );
-glAttachShader ( ProgramID, FragmentShaderID );
-glLinkProgram ( ProgramID );
-
-    // Check the program
-glGetProgramiv ( ProgramID, GL_LINK_STATUS, &Result );
-glGetProgramiv ( ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength );
-std::vector<char> ProgramErrorMessage( max ( InfoLogLength, int( 1 ) ) );
-glGetProgramInfoLog ( ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0] );
-    //    fprintf(stdout, "%s\n", &ProgramErrorMessage[0]);
-
-glDeleteShader ( VertexShaderID );
-glDeleteShader ( FragmentShaderID );
-return ProgramID;
+/* Modification time to the nanosecond, so two saves within a second are both seen */
+double modifiedTime ( const string &path )
+{
+    struct stat info;
+    return stat ( path.c_str ( ), &info ) == 0 ? info.st_mtim.tv_sec + info.st_mtim.tv_nsec * 1e-9 : 0;
 }
 
-static void error_callback ( int error, const char* description )
+/* FNV-1a over every source and the driver, so a driver update never loads a stale binary */
+uint64_t sourceHash ( const string &vertex, const string &geometry, const string &fragment )
 {
-    fprintf ( stderr, "Error: %s\n", description );
+    string key = vertex + '\0' + geometry + '\0' + fragment + '\0' + ( const char * ) glGetString ( GL_RENDERER ) + ( const char * ) glGetString ( GL_VERSION );
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for ( size_t i = 0; i < key.size ( ); i++ )
+        hash = ( hash ^ ( unsigned char ) key[ i ] ) * 0x100000001b3ull;
+    return hash;
 }
 
-void quit ( GLFWwindow *window )
+string binaryPath ( uint64_t hash )
 {
-    glfwDestroyWindow ( window );
-    glfwTerminate ( );
-    exit ( EXIT_SUCCESS );
+    char name [ 64 ];
+    snprintf ( name, sizeof ( name ), "/%016llx.bin", ( unsigned long long ) hash );
+    return shader_cache_dir + string ( name );
+}
+
+/* Load a cached binary into program, false if there is none or the driver rejects it */
+bool loadProgramBinary ( uint64_t hash, GLuint program )
+{
+    string data;
+    if ( ! shaderBinaries || ! readFile ( binaryPath ( hash ), data ) || data.size ( ) <= sizeof ( GLenum ) )
+        return false;
+    GLenum format;
+    memcpy ( &format, data.data ( ), sizeof ( format ) );
+    glProgramBinary ( program, format, data.data ( ) + sizeof ( format ), data.size ( ) - sizeof ( format ) );
+    GLint linked = GL_FALSE;
+    glGetProgramiv ( program, GL_LINK_STATUS, &linked );
+    return linked == GL_TRUE;
+}
+
+void saveProgramBinary ( uint64_t hash, GLuint program )
+{
+    GLint length = 0;
+    glGetProgramiv ( program, GL_PROGRAM_BINARY_LENGTH, &length );
+    if ( ! shaderBinaries || length <= 0 )
+        return;
+    vector < char > data ( sizeof ( GLenum ) + length );
+    GLenum format;
+    glGetProgramBinary ( program, length, NULL, &format, &data[ sizeof ( format ) ] );
+    memcpy ( &data[0], &format, sizeof ( format ) );
+
+    mkdir ( shader_cache_dir, 0755 );
+    FILE *file = fopen ( binaryPath ( hash ).c_str ( ), "wb" );
+    if ( file ) {
+        fwrite ( &data[0], 1, data.size ( ), file );
+        fclose ( file );
+    }
+}
+
+/* Print the info log of a shader or program that failed */
+void printShaderLog ( GLuint object, bool program, const string &name )
+{
+    GLint length = 0;
+    if ( program )
+        glGetProgramiv ( object, GL_INFO_LOG_LENGTH, &length );
+    else
+        glGetShaderiv ( object, GL_INFO_LOG_LENGTH, &length );
+    vector < char > log ( max ( length, 1 ) );
+    if ( program )
+        glGetProgramInfoLog ( object, log.size ( ), NULL, &log[0] );
+    else
+        glGetShaderInfoLog ( object, log.size ( ), NULL, &log[0] );
+    fprintf ( stderr, "%s :\n%s\n", name.c_str ( ), &log[0] );
+}
+
+GLuint startCompile ( GLenum type, const string &source )
+{
+    GLuint shader = glCreateShader ( type );
+    const char *text = source.c_str ( );
+    glShaderSource ( shader, 1, &text, NULL );
+    glCompileShader ( shader );
+    return shader;
+}
+
+/* Start building a program : from the binary cache when possible, otherwise compile and link
+   without waiting, so the driver can work on every program at once */
+bool beginShaderBuild ( ShaderProgram &shader )
+{
+    string vertex, geometry, fragment;
+    if ( ! readFile ( shader.vertexPath, vertex ) || ! readFile ( shader.fragmentPath, fragment ) ||
+         ( ! shader.geometryPath.empty ( ) && ! readFile ( shader.geometryPath, geometry ) ) ) {
+        fprintf ( stderr, "cannot read %s, %s or %s\n", shader.vertexPath.c_str ( ), shader.geometryPath.c_str ( ), shader.fragmentPath.c_str ( ) );
+        return false;
+    }
+    shader.vertexTime = modifiedTime ( shader.vertexPath );
+    shader.geometryTime = modifiedTime ( shader.geometryPath );
+    shader.fragmentTime = modifiedTime ( shader.fragmentPath );
+    shader.hash = sourceHash ( vertex, geometry, fragment );
+    shader.building = glCreateProgram ( );
+    gpuStats.programs += 1;
+    shader.vertexShader = shader.geometryShader = shader.fragmentShader = 0;
+
+    shader.cached = loadProgramBinary ( shader.hash, shader.building );
+    if ( shader.cached )
+        return true;
+
+    shader.vertexShader = startCompile ( GL_VERTEX_SHADER, vertex );
+    shader.fragmentShader = startCompile ( GL_FRAGMENT_SHADER, fragment );
+    glAttachShader ( shader.building, shader.vertexShader );
+    glAttachShader ( shader.building, shader.fragmentShader );
+    if ( ! geometry.empty ( ) ) {
+        shader.geometryShader = startCompile ( GL_GEOMETRY_SHADER, geometry );
+        glAttachShader ( shader.building, shader.geometryShader );
+    }
+    if ( shaderBinaries )
+        glProgramParameteri ( shader.building, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE );
+    glLinkProgram ( shader.building );
+    return true;
+}
+
+/* Wait for a build to finish, report any error with its log and cache the new binary;
+   on success the program is in shader.building */
+bool endShaderBuild ( ShaderProgram &shader )
+{
+    bool ok = true;
+    if ( ! shader.cached ) {
+        GLint status = GL_FALSE;
+        glGetProgramiv ( shader.building, GL_LINK_STATUS, &status );
+        ok = status == GL_TRUE;
+        if ( ! ok ) {
+            glGetShaderiv ( shader.vertexShader, GL_COMPILE_STATUS, &status );
+            if ( status != GL_TRUE )
+                printShaderLog ( shader.vertexShader, false, shader.vertexPath );
+            if ( shader.geometryShader ) {
+                glGetShaderiv ( shader.geometryShader, GL_COMPILE_STATUS, &status );
+                if ( status != GL_TRUE )
+                    printShaderLog ( shader.geometryShader, false, shader.geometryPath );
+            }
+            glGetShaderiv ( shader.fragmentShader, GL_COMPILE_STATUS, &status );
+            if ( status != GL_TRUE )
+                printShaderLog ( shader.fragmentShader, false, shader.fragmentPath );
+            printShaderLog ( shader.building, true, shader.vertexPath + " + " + shader.fragmentPath );
+        }
+        else
+            saveProgramBinary ( shader.hash, shader.building );
+        glDeleteShader ( shader.vertexShader );
+        glDeleteShader ( shader.geometryShader );
+        glDeleteShader ( shader.fragmentShader );
+    }
+    if ( ! ok ) {
+        releaseProgram ( shader.building, 0 );
+        shader.building = 0;
+    }
+    return ok;
+}
+
+/* Driver storage of a linked program, taken as the size of its binary, counted in gpuStats
+   until the program is released; 0 where binaries cannot be read back */
+long countProgramBytes ( GLuint program )
+{
+    GLint length = 0;
+    if ( program && shaderBinaries )
+        glGetProgramiv ( program, GL_PROGRAM_BINARY_LENGTH, &length );
+    gpuStats.bytes += length;
+    return length;
+}
+
+int addShaderProgram ( const char *vertexPath, const char *fragmentPath, const char *geometryPath = "" )
+{
+    ShaderProgram shader;
+    shader.vertexPath = vertexPath;
+    shader.geometryPath = geometryPath;
+    shader.fragmentPath = fragmentPath;
+    shaderPrograms.push_back ( std::move ( shader ) );
+    return shaderPrograms.size ( ) - 1;
+}
+
+/* Build every program at startup and report how long it took, warm when all came from the cache */
+void buildShaderPrograms ( )
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now ( );
+
+    GLint formats = 0;
+    if ( GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary )
+        glGetIntegerv ( GL_NUM_PROGRAM_BINARY_FORMATS, &formats );
+    shaderBinaries = formats > 0;
+    if ( GLEW_KHR_parallel_shader_compile )
+        glMaxShaderCompilerThreadsKHR ( 0xFFFFFFFF );
+
+    bool ok = true;
+    for ( size_t p = 0; p < shaderPrograms.size ( ); p++ )
+        ok = beginShaderBuild ( shaderPrograms[ p ] ) && ok;
+    int cached = 0;
+    for ( size_t p = 0; p < shaderPrograms.size ( ) && ok; p++ ) {
+        ok = endShaderBuild ( shaderPrograms[ p ] );
+        shaderPrograms[ p ].id.reset ( shaderPrograms[ p ].building, countProgramBytes ( shaderPrograms[ p ].building ) );
+        cached += shaderPrograms[ p ].cached;
+    }
+    if ( ! ok )
+        exit ( EXIT_FAILURE );
+
+    double ms = chrono::duration < double, milli > ( chrono::steady_clock::now ( ) - start ).count ( );
+    fprintf ( stdout, "Shaders : %d programs, %d from the binary cache ( %s start ), %.2f ms%s\n",
+              ( int ) shaderPrograms.size ( ), cached, cached == ( int ) shaderPrograms.size ( ) ? "warm" : "cold", ms,
+              shaderBinaries ? "" : ", program binaries not supported" );
+}
+
+/* Rebuild the programs whose sources changed; true when any was replaced.  A program that
+   fails to build keeps running its previous version */
+bool reloadShaderPrograms ( )
+{
+    bool replaced = false;
+    for ( size_t p = 0; p < shaderPrograms.size ( ); p++ ) {
+        ShaderProgram &shader = shaderPrograms[ p ];
+        if ( modifiedTime ( shader.vertexPath ) == shader.vertexTime && modifiedTime ( shader.geometryPath ) == shader.geometryTime &&
+             modifiedTime ( shader.fragmentPath ) == shader.fragmentTime )
+            continue;
+        if ( ! beginShaderBuild ( shader ) || ! endShaderBuild ( shader ) ) {
+            fprintf ( stderr, "Shaders : keeping the previous %s + %s\n", shader.vertexPath.c_str ( ), shader.fragmentPath.c_str ( ) );
+            continue;
+        }
+        shader.id.reset ( shader.building, countProgramBytes ( shader.building ) );
+        replaced = true;
+        fprintf ( stdout, "Shaders : reloaded %s + %s\n", shader.vertexPath.c_str ( ), shader.fragmentPath.c_str ( ) );
+    }
+    return replaced;
+}
+
+static void error_callback ( int error, const char* description )
+{
+    fprintf ( stderr, "Error: %s\n", description );
 }
 
 void initGLEW ( void ) 
 {
     glewExperimental = GL_TRUE;
-    if ( glewInit ( ) != GLEW_OK ) {
-        fprintf ( stderr,"Glew failed to initialize : %s\n", glewGetErrorString ( glewInit ( ) ) );
+    GLenum status = glewInit ( );
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    // a GLX build of GLEW loads every entry point before noticing an EGL context has no GLX display
+    if ( status == GLEW_ERROR_NO_GLX_DISPLAY )
+        status = GLEW_OK;
+#endif
+    if ( status != GLEW_OK ) {
+        fprintf ( stderr,"Glew failed to initialize : %s\n", glewGetErrorString ( status ) );
    }
    if ( ! GLEW_VERSION_3_3 )
        fprintf ( stderr, "3.3 version not available\n" );
 }
 
 /* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+MeshHandle create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
 {
-    struct VAO* vao = new struct VAO;
+    MeshHandle vao ( new VAO );
+    vao->InstanceBuffer = 0;
+    vao->IndexBuffer = 0;
     vao->PrimitiveMode = primitive_mode;
     vao->NumVertices = numVertices;
+    vao->NumIndices = 0;
     vao->FillMode = fill_mode;
+    vao->Format = FORMAT_FLOAT;
 
     // Create Vertex Array Object
     // Should be done after CreateWindow and before any other GL calls
     glGenVertexArrays (1, &(vao->VertexArrayID ) ); // VAO
     glGenBuffers (1, &(vao->VertexBuffer ) ); // VBO - vertices
     glGenBuffers (1, &(vao->ColorBuffer ) );  // VBO - colors
-
-    glBindVertexArray ( vao->VertexArrayID ); // Bind the VAO 
-    glBindBuffer ( GL_ARRAY_BUFFER, vao->VertexBuffer ); // Bind the VBO vertices 
+    gpuStats.vertexArrays += 1;
+    gpuStats.buffers += 2;
+    profiler.count ( prof::COUNTER_OBJECTS, 3 );
+    vao->Bytes = 2*3*numVertices*sizeof(GLfloat);
+    gpuStats.bytes += vao->Bytes;
+
+    bindVertexArray ( vao->VertexArrayID ); // Bind the VAO 
+    bindArrayBuffer ( vao->VertexBuffer ); // Bind the VBO vertices 
     glBufferData ( GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW ); // Copy the vertices into VBO
     glVertexAttribPointer (
                           0,                  // attribute 0. Vertices
@@ -161,8 +575,9 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
                           0,                  // stride
                           (void*)0            // array buffer offset
                           );
+    glEnableVertexAttribArray ( 0 );
 
-    glBindBuffer ( GL_ARRAY_BUFFER, vao->ColorBuffer ); // Bind the VBO colors 
+    bindArrayBuffer ( vao->ColorBuffer ); // Bind the VBO colors 
     glBufferData ( GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW );  // Copy the vertex colors
     glVertexAttribPointer(
                           1,                  // attribute 1. Color
@@ -172,44 +587,180 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
                           0,                  // stride
                           (void*)0            // array buffer offset
                           );
+    glEnableVertexAttribArray ( 1 );
 
     return vao;
 }
 
 /* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
-struct VAO* create3DObject ( GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL )
+MeshHandle create3DObject ( GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL )
 {
-    GLfloat* color_buffer_data = new GLfloat [3*numVertices];
+    vector < GLfloat > color_buffer_data ( 3*numVertices );
     for ( int i = 0; i < numVertices; i++) {
         color_buffer_data [3*i] = red;
         color_buffer_data [3*i + 1] = green;
         color_buffer_data [3*i + 2] = blue;
     }
 
-    return create3DObject ( primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode );
+    return create3DObject ( primitive_mode, numVertices, vertex_buffer_data, &color_buffer_data[0], fill_mode );
 }
 
-/* Render the VBOs handled by VAO */
-void draw3DObject ( struct VAO* vao )
+/* Interleaved vertex layouts, 24 and 12 bytes */
+struct FloatVertex {
+    GLfloat position [ 3 ];
+    GLfloat color [ 3 ];
+};
+
+struct PackedVertex {
+    GLhalf position [ 4 ];      // fourth component pads the colour to a 4 byte boundary
+    GLubyte color [ 4 ];
+};
+
+/* IEEE 754 half precision, round to nearest, enough for mesh local coordinates */
+GLhalf toHalf ( float value )
 {
-    // Change the Fill Mode for this object
-    glPolygonMode ( GL_FRONT_AND_BACK, vao->FillMode );
+    unsigned int bits;
+    memcpy ( &bits, &value, sizeof ( bits ) );
+
+    unsigned int sign = ( bits >> 16 ) & 0x8000;
+    int exponent = ( int ) ( ( bits >> 23 ) & 0xff ) - 127 + 15;
+    unsigned int mantissa = bits & 0x7fffff;
+
+    if ( exponent <= 0 )
+        return ( GLhalf ) sign;                     // too small, flush to zero
+    if ( exponent >= 31 )
+        return ( GLhalf ) ( sign | 0x7c00 );        // too large, infinity
+
+    unsigned int half = sign | ( exponent << 10 ) | ( mantissa >> 13 );
+    if ( mantissa & 0x1000 )
+        half++;
+    return ( GLhalf ) half;
+}
 
-    // Bind the VAO to use
-    glBindVertexArray ( vao->VertexArrayID );
+/* Generate an indexed, interleaved VAO : vertices sharing position and colour are stored once */
+MeshHandle createIndexedObject ( GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, VertexFormat format, GLenum fill_mode=GL_FILL )
+{
+    if ( format == FORMAT_FLOAT )
+        return create3DObject ( primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode );
+
+    // Weld identical vertices
+    vector < FloatVertex > unique;
+    vector < GLuint > indices ( numVertices );
+    map < string, GLuint > seen;
+    for ( int i = 0; i < numVertices; i++ ) {
+        FloatVertex v;
+        memcpy ( v.position, &vertex_buffer_data[ 3*i ], sizeof ( v.position ) );
+        memcpy ( v.color, &color_buffer_data[ 3*i ], sizeof ( v.color ) );
+        string key ( ( const char * ) &v, sizeof ( v ) );
+        map < string, GLuint >::iterator it = seen.find ( key );
+        if ( it == seen.end ( ) ) {
+            it = seen.insert ( make_pair ( key, ( GLuint ) unique.size ( ) ) ).first;
+            unique.push_back ( v );
+        }
+        indices[ i ] = it->second;
+    }
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray ( 0 );
-    // Bind the VBO to use
-    glBindBuffer ( GL_ARRAY_BUFFER, vao->VertexBuffer );
+    // Narrowest index type that addresses every unique vertex
+    vector < GLubyte > index_data;
+    GLenum index_type;
+    int index_size;
+    if ( unique.size ( ) <= 0xff ) {
+        index_type = GL_UNSIGNED_BYTE;
+        index_size = 1;
+    }
+    else if ( unique.size ( ) <= 0xffff ) {
+        index_type = GL_UNSIGNED_SHORT;
+        index_size = 2;
+    }
+    else {
+        index_type = GL_UNSIGNED_INT;
+        index_size = 4;
+    }
+    index_data.resize ( numVertices * index_size );
+    for ( int i = 0; i < numVertices; i++ ) {
+        if ( index_size == 1 )
+            index_data[ i ] = ( GLubyte ) indices[ i ];
+        else if ( index_size == 2 )
+            ( ( GLushort * ) &index_data[0] )[ i ] = ( GLushort ) indices[ i ];
+        else
+            ( ( GLuint * ) &index_data[0] )[ i ] = indices[ i ];
+    }
+
+    // Encode the vertex data in the requested layout
+    vector < PackedVertex > packed;
+    const void *vertex_data = &unique[0];
+    int stride = sizeof ( FloatVertex );
+    if ( format == FORMAT_PACKED ) {
+        packed.resize ( unique.size ( ) );
+        for ( size_t i = 0; i < unique.size ( ); i++ ) {
+            for ( int k = 0; k < 3; k++ ) {
+                packed[ i ].position[ k ] = toHalf ( unique[ i ].position[ k ] );
+                float c = unique[ i ].color[ k ] < 0 ? 0 : ( unique[ i ].color[ k ] > 1 ? 1 : unique[ i ].color[ k ] );
+                packed[ i ].color[ k ] = ( GLubyte ) ( c * 255.0f + 0.5f );
+            }
+            packed[ i ].position[ 3 ] = toHalf ( 1.0f );
+            packed[ i ].color[ 3 ] = 255;
+        }
+        vertex_data = &packed[0];
+        stride = sizeof ( PackedVertex );
+    }
 
-    // Enable Vertex Attribute 1 - Color
+    MeshHandle vao ( new VAO );
+    vao->ColorBuffer = 0;
+    vao->InstanceBuffer = 0;
+    vao->PrimitiveMode = primitive_mode;
+    vao->FillMode = fill_mode;
+    vao->Format = format;
+    vao->IndexType = index_type;
+    vao->NumVertices = unique.size ( );
+    vao->NumIndices = numVertices;
+
+    glGenVertexArrays ( 1, &( vao->VertexArrayID ) );
+    glGenBuffers ( 1, &( vao->VertexBuffer ) );
+    glGenBuffers ( 1, &( vao->IndexBuffer ) );
+    gpuStats.vertexArrays += 1;
+    gpuStats.buffers += 2;
+    profiler.count ( prof::COUNTER_OBJECTS, 3 );
+    vao->Bytes = unique.size ( ) * stride + index_data.size ( );
+    gpuStats.bytes += vao->Bytes;
+
+    bindVertexArray ( vao->VertexArrayID );
+
+    bindArrayBuffer ( vao->VertexBuffer );
+    glBufferData ( GL_ARRAY_BUFFER, unique.size ( ) * stride, vertex_data, GL_STATIC_DRAW );
+    if ( format == FORMAT_PACKED ) {
+        glVertexAttribPointer ( 0, 3, GL_HALF_FLOAT, GL_FALSE, stride, ( void* ) offsetof ( PackedVertex, position ) );
+        glVertexAttribPointer ( 1, 3, GL_UNSIGNED_BYTE, GL_TRUE, stride, ( void* ) offsetof ( PackedVertex, color ) );
+    }
+    else {
+        glVertexAttribPointer ( 0, 3, GL_FLOAT, GL_FALSE, stride, ( void* ) offsetof ( FloatVertex, position ) );
+        glVertexAttribPointer ( 1, 3, GL_FLOAT, GL_FALSE, stride, ( void* ) offsetof ( FloatVertex, color ) );
+    }
+    glEnableVertexAttribArray ( 0 );
     glEnableVertexAttribArray ( 1 );
-    // Bind the VBO to use
-    glBindBuffer ( GL_ARRAY_BUFFER, vao->ColorBuffer );
+
+    // The element buffer binding is recorded in the VAO
+    glBindBuffer ( GL_ELEMENT_ARRAY_BUFFER, vao->IndexBuffer );
+    glBufferData ( GL_ELEMENT_ARRAY_BUFFER, index_data.size ( ), &index_data[0], GL_STATIC_DRAW );
+
+    return vao;
+}
+
+/* Render the VBOs handled by VAO */
+void draw3DObject ( const VAO *vao )
+{
+    // Change the Fill Mode for this object
+    polygonMode ( vao->FillMode );
+
+    // Bind the VAO to use; its attributes and buffers were recorded when it was created
+    bindVertexArray ( vao->VertexArrayID );
 
     // Draw the geometry !
-    glDrawArrays ( vao->PrimitiveMode, 0, vao->NumVertices ); // Starting from vertex 0; 3 vertices total -> 1 triangle
+    if ( vao->IndexBuffer )
+        glDrawElements ( vao->PrimitiveMode, vao->NumIndices, vao->IndexType, ( void* ) 0 );
+    else
+        glDrawArrays ( vao->PrimitiveMode, 0, vao->NumVertices ); // Starting from vertex 0; 3 vertices total -> 1 triangle
+    profiler.count ( prof::COUNTER_DRAWS );
 }
 
 int perspective = 0;
@@ -218,28 +769,23 @@ int perspective = 0;
 void reshapeWindow ( GLFWwindow* window, int width, int height )
 {
     int fbwidth=width, fbheight=height;
-    glfwGetFramebufferSize( window, &fbwidth, &fbheight );
-
-    GLfloat fov = M_PI/2;
+    if ( window )
+        glfwGetFramebufferSize( window, &fbwidth, &fbheight );
 
     // sets the viewport of openGL renderer
     glViewport ( 0, 0, (GLsizei) fbwidth, (GLsizei) fbheight );
 
-    // Store the projection matrix in a variable for future use
-    // Perspective projection for 3D views
-    Matrices.projectionP = glm::perspective ( fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1f, 500.0f );
+    // Perspective projection for 3D views, built per viewport in viewProjection
+    Matrices.fov = M_PI/2;
 
     // Ortho projection for 2D views
     Matrices.projectionO = glm::ortho ( -4.0f, 4.0f, -4.0f, 4.0f, 0.1f, 500.0f );
 }
 
-GLfloat *createColor ( float r1, float g1, float b1, 
+vector < GLfloat > createColor ( float r1, float g1, float b1, 
                                     float r2, float g2, float b2,
                                     float r3, float g3, float b3) {
-    
-        GLfloat *color_buffer_data = ( GLfloat * ) malloc ( sizeof ( float ) * 108 );
-    
-        GLfloat Color [ ] = {
+    GLfloat Color [ ] = {
         r1, g1, b1, r1, g1, b1, r1, g1, b1, r1, g1, b1, r1, g1, b1, r1, g1, b1,  //1
         r2, g2, b2, r2, g2, b2, r2, g2, b2, r2, g2, b2, r2, g2, b2, r2, g2, b2,  //2
         r3, g3, b3, r3, g3, b3, r3, g3, b3, r3, g3, b3, r3, g3, b3, r3, g3, b3,  //3 
@@ -249,15 +795,13 @@ GLfloat *createColor ( float r1, float g1, float b1,
         r3, g3, b3, r3, g3, b3, r3, g3, b3, r3, g3, b3, r3, g3, b3, r3, g3, b3, //6
     };
     
-    for ( int i = 0; i < 108; i++ )
-        color_buffer_data[ i ] = Color[ i ];
-
-    return color_buffer_data;
+    return vector < GLfloat > ( Color, Color + 108 );
 }
 
-VAO *createCell ( float l, float b, float h, GLfloat Color [ ] )
+/* Fill vertex_buffer_data with the 36 vertices of an l x b x h box */
+void cellVertices ( float l, float b, float h, GLfloat vertex_buffer_data [ ] )
 {
-    GLfloat vertex_buffer_data [ ] = {
+    GLfloat Vertices [ ] = {
         0, 0, 0, b, 0, 0, b, h, 0, b, h, 0, 0, h, 0, 0, 0 , 0,        //1
         0, 0, 0, 0, h, 0, 0, h, l, 0, h, l, 0, 0, l, 0, 0, 0,    //2
         0, 0, 0, 0, 0, l, b, 0, l, b, 0, l, b, 0, 0, 0, 0, 0,        //3 
@@ -267,7 +811,16 @@ VAO *createCell ( float l, float b, float h, GLfloat Color [ ] )
         0, h, l, b, h, l, b, h, 0, b, h, 0, 0, h, 0, 0, h, l         //6
     };
 
-    return create3DObject ( GL_TRIANGLES, 36, vertex_buffer_data, Color, GL_FILL );
+    for ( int i = 0; i < 108; i++ )
+        vertex_buffer_data[ i ] = Vertices[ i ];
+}
+
+MeshHandle createCell ( float l, float b, float h, const GLfloat Color [ ], VertexFormat format = FORMAT_PACKED )
+{
+    GLfloat vertex_buffer_data [ 108 ];
+    cellVertices ( l, b, h, vertex_buffer_data );
+
+    return createIndexedObject ( GL_TRIANGLES, 36, vertex_buffer_data, Color, format, GL_FILL );
 }
 
 class GraphicalObject
@@ -277,6 +830,7 @@ public:
     float x_ordinate;
     float y_ordinate;
     float z_ordinate;
+    float y_previous;       // y_ordinate at the start of the current tick
     float height;
     float length;
     char color;
@@ -285,46 +839,111 @@ public:
     glm::mat4 translate_matrix;
     glm::mat4 rotate_matrix;
 
+private:
+    // What each matrix was built from, so setting the same value again costs nothing
+    glm::vec4 Irotation, rotation;             // angle, then axis
+    glm::vec3 Itranslation, translation;
+
+    // Cached products, rebuilt only when a part changes
+    glm::mat4 world_matrix;
+    glm::mat4 MVP;
+    bool dirty;
+    int VPVersion;          // Matrices.VPVersion that MVP was built with
+
 public:
     GraphicalObject ( float X=0, float Y=0, float Z=0, float H=0, float L=0, char colour='D' )
     {
       x_ordinate = X;
       y_ordinate = Y;
       z_ordinate = Z;
+      y_previous = Y;
       height = H;
       length = L;
       color = colour;
+      Irotation = rotation = glm::vec4 ( 0, 0, 0, 1 );
+      Itranslation = translation = glm::vec3 ( 0, 0, 0 );
+      dirty = true;
+      VPVersion = -1;
+  }
+
+  /* Remember the height at the start of a tick so frames drawn before the next one can interpolate */
+  void snapshot ( )
+  {
+      y_previous = y_ordinate;
+  }
+
+  float interpolatedY ( float alpha )
+  {
+      return y_previous + ( y_ordinate - y_previous ) * alpha;
   }
 
   void Irotator ( float rotation = 0, glm::vec3 rotating_vector = glm::vec3 ( 0, 0, 1 ) ) 
   {
+    glm::vec4 key ( rotation, rotating_vector.x, rotating_vector.y, rotating_vector.z );
+    if ( key == Irotation )
+        return;
+    Irotation = key;
     Irotate_matrix = glm::rotate ( (float)(rotation*M_PI/180.0f), rotating_vector );
+    dirty = true;
   }
  
-  void rotator ( float rotation = 0, glm::vec3 rotating_vector = glm::vec3 ( 0, 0, 1 ) )
+  void rotator ( float angle = 0, glm::vec3 rotating_vector = glm::vec3 ( 0, 0, 1 ) )
   {
-      rotate_matrix = glm::rotate ( (float)(rotation*M_PI/180.0f), rotating_vector );
+      glm::vec4 key ( angle, rotating_vector.x, rotating_vector.y, rotating_vector.z );
+      if ( key == rotation )
+          return;
+      rotation = key;
+      rotate_matrix = glm::rotate ( (float)(angle*M_PI/180.0f), rotating_vector );
+      dirty = true;
   }
  
   void translator (float x = 0, float y = 0, float z = 0 )
   {
-        translate_matrix = glm::translate ( glm::vec3 ( x, y, z ) );
+        glm::vec3 key ( x, y, z );
+        if ( key == translation )
+            return;
+        translation = key;
+        translate_matrix = glm::translate ( key );
+        dirty = true;
   }
 
   void Itranslator (float x = 0, float y = 0, float z = 0 )
   {
-        Itranslate_matrix = glm::translate ( glm::vec3 ( x, y, z ) );
+        glm::vec3 key ( x, y, z );
+        if ( key == Itranslation )
+            return;
+        Itranslation = key;
+        Itranslate_matrix = glm::translate ( key );
+        dirty = true;
+  }
+
+  const glm::mat4 &world ( )
+  {
+      if ( dirty ) {
+          world_matrix = translate_matrix*rotate_matrix*Itranslate_matrix*Irotate_matrix;
+          profiler.count ( prof::COUNTER_MATRICES );
+          dirty = false;
+          VPVersion = -1;
+      }
+      return world_matrix;
+  }
+
+  const glm::mat4 &mvp ( )
+  {
+      world ( );
+      if ( VPVersion != Matrices.VPVersion ) {
+          MVP = Matrices.VP * world_matrix;
+          profiler.count ( prof::COUNTER_MATRICES );
+          VPVersion = Matrices.VPVersion;
+      }
+      return MVP;
   }
 
-  void render ( )
+  /* Where the object's origin is in the world, to order it by distance from the camera */
+  glm::vec3 position ( )
   {
-      glm::mat4 VP = ( perspective ? Matrices.projectionP : Matrices.projectionO ) * Matrices.view;
-      glm::mat4 MVP;
-      Matrices.model = glm::mat4 ( 1.0f );
-      Matrices.model *= translate_matrix*rotate_matrix*Itranslate_matrix*Irotate_matrix;
-      MVP = VP * Matrices.model;
-      glUniformMatrix4fv ( Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0] );
-      draw3DObject ( object );
+      const glm::vec4 &origin = world ( )[ 3 ];
+      return glm::vec3 ( origin.x, origin.y, origin.z );
   }
 
 };
@@ -408,182 +1027,594 @@ GLfloat darkyellow[] = {
                                         1,1,0
                                     };
 
-GLfloat *Grey = createColor ( 0.30196, 0.30196, 0.30196, 
+vector < GLfloat > Grey = createColor ( 0.30196, 0.30196, 0.30196, 
                                                 0.50196, 0.50196, 0.50196,
                                                 0.85098, 0.85098, 0.85098 ); 
 
-GLfloat *White = createColor ( 0.54902, 0.54902, 0.54902,
+vector < GLfloat > White = createColor ( 0.54902, 0.54902, 0.54902,
                                                     0.8, 0.8, 0.8,
                                                     0.94902, 0.94902, 0.94902 );
 
-GLfloat *Blue = createColor ( 0, 0.52549, 0.70196,
+vector < GLfloat > Blue = createColor ( 0, 0.52549, 0.70196,
                                                     0, 0.74902, 1,
                                                     0.50196, 0.87451, 1 );
 
-GLfloat *Green = createColor ( 0.45098, 0.6, 0,
+vector < GLfloat > Green = createColor ( 0.45098, 0.6, 0,
                                                         0.6, 0.8, 0,
                                                         0.82353, 1,  0.30196);
 
-GLfloat *Orange = createColor ( 0.70196, 0.56078, 0,
+vector < GLfloat > Violet = createColor ( 0.4, 0.18039, 0.6,
+                                                        0.52157, 0.25098, 0.76078,
+                                                        0.72157, 0.50196, 0.94902 );
+
+vector < GLfloat > Red = createColor ( 0.6, 0.12157, 0.12157,
+                                                        0.78039, 0.18039, 0.18039,
+                                                        1, 0.4, 0.4 );
+
+vector < GLfloat > Orange = createColor ( 0.70196, 0.56078, 0,
                                                         0.8, 0.63922, 0,
                                                         1, 0.83922,  0.2 );
 
-GLfloat *Dorange = createColor ( 0.8, 0.63922, 0,
+vector < GLfloat > Dorange = createColor ( 0.8, 0.63922, 0,
                                                             0.90196, 0.72157, 0,
                                                             1, 0.87843, 0.4 );
 
-static const int board_size = 20;
-    
-int board[ board_size ][ board_size ];
-
-int stage1 [board_size][board_size] = {
-        {1,1,1,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0},
-        {1,1,1,1,1,1,0,0,0,0, 0,0,0,0,0,0,0,0,0,0},
-        {1,1,1,1,1,1,1,1,1,0,0,0,0,0,0,0,0,0,0,0},
-        {0,1,1,1,1,1,1,1,1,1,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,1,1,2,1,1,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,1,1,1,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-    };
+// Palette entries used by the instanced board, each holding three face shades
+enum { PALETTE_GREY, PALETTE_WHITE, PALETTE_ORANGE, PALETTE_DORANGE, PALETTE_GREEN, PALETTE_VIOLET, PALETTE_RED, palette_size };
 
- int stage2 [board_size][board_size] = {
-        {1,1,1,3,3,3,3,3,3,3,1,1,0,0,0,0,0,0,0,0},
-        {1,1,1,3,3,3,3,3,3,3,1,1,0,0,0,0,0,0,0,0},
-        {1,1,1,1,0,0,0,0,0,1,1,1,0,0,0,0,0,0,0,0},
-        {1,1,1,0,0,1,1,1,1,3,3,3,3,3,0,0,0,0,0,0},
-        {1,1,1,0,0,1,1,1,1,3,3,3,3,3,0,0,0,0,0,0},
-        {0,0,0,0,0,1,2,1,0,0,3,3,1,3,0,0,0,0,0,0},
-        {0,0,0,0,0,1,1,1,0,0,3,3,3,3,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-        {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-    };    
-
-int stage3 [board_size][board_size]  = {
-    {1,1,1,1,0,0,1,1,1,1,0,0,1,1,1,0,0,0,0,0},
-    {1,1,4,1,0,0,1,1,5,1,0,0,1,2,1,0,0,0,0,0},
-    {1,1,1,1,0,0,1,1,1,1,0,0,1,1,1,0,0,0,0,0},
-    {1,1,1,1,7,7,1,1,1,1,7,7,1,1,1,0,0,0,0,0},
-    {1,1,1,1,0,0,1,1,1,1,0,0,0,0,0,0,0,0,0,0},
-    {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-    {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-    {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-    {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-    {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-    {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-    {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-    {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-    {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-    {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-    {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-    {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-    {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-    {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-    {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}
-    };
+const GLfloat *paletteColors [ palette_size ] = { &Grey[0], &White[0], &Orange[0], &Dorange[0], &Green[0], &Violet[0], &Red[0] };
 
-int stage4 [board_size][board_size] = {
+// One cell mesh per palette entry, shared by every tile of that material in every level
+MeshHandle materialMeshes [ palette_size ];
 
+/* Per tile data streamed to the instanced board, 16 bytes per tile */
+struct TileInstance {
+    GLfloat x_ordinate;
+    GLfloat y_ordinate;
+    GLfloat z_ordinate;
+    GLubyte palette;
+    GLubyte visible;
+    GLubyte padding [ 2 ];
 };
 
-glm::vec3 eye; 
-glm::vec3 target;
+vector < TileInstance > tileInstances;
+GLsizeiptr tileInstanceBytes = 0;      // size of the instance buffer, grown for larger levels
+const int tile_instance_reserve = 400; // tiles the instance buffer starts out holding
 
-map < int , vector< int > > bridgeMap;    
+// Cells of the current level that hold a tile, chunk by chunk as sim::Level::forEachTile
+// visits them, built when the level loads so the board is walked in proportion to its
+// tiles rather than its area.  Tiles sit at x = col * 0.3, z = row * 0.3
+struct ActiveTile {
+    int row;
+    int col;
+    float y_ordinate;
+    float y_previous;       // y_ordinate at the start of the current tick
+    GLubyte palette;
 
-float theta = 0.0f, 
-        z_ordinate = 0.0f, 
-        y_ordinate = 0.0f, 
-        x_ordinate = 0.0f,
-        camera_rotation_angle = 70.0f;
+    // VP times the tile's position, the last column of its MVP when drawn on its own, and
+    // the height and Matrices.VPVersion it was built for
+    glm::vec4 clipOrigin;
+    float clipY;
+    int VPVersion;
 
-int level = 1, stageStart = 1, 
-    prev_Bridge = 4, prevBridge[10], bridge[10],
-    presentState = 0, futureState = 0, direction = 5,
-    views = 4, moves = 0,
-    left_button = 0, right_button = 0;
-    
-double oldMousex, oldMousey;
+    float interpolatedY ( float alpha ) const
+    {
+        return y_previous + ( y_ordinate - y_previous ) * alpha;
+    }
 
-VAO *axes, 
-        *cell, 
-        *background;
+    glm::vec3 position ( float y ) const
+    {
+        return glm::vec3 ( col * 0.3f - 1, y, row * 0.3f - 1 );
+    }
 
-GraphicalObject Block, 
-                            Board[20][20];
+    /* MVP of the tile at height y : VP with the tile's position in its last column, which is
+       only rebuilt when the tile has moved or VP changed */
+    glm::mat4 mvp ( float y )
+    {
+        if ( VPVersion != Matrices.VPVersion || y != clipY ) {
+            clipOrigin = Matrices.VP * glm::vec4 ( position ( y ), 1.0f );
+            profiler.count ( prof::COUNTER_MATRICES );
+            clipY = y;
+            VPVersion = Matrices.VPVersion;
+        }
+        glm::mat4 MVP = Matrices.VP;
+        MVP[ 3 ] = clipOrigin;
+        return MVP;
+    }
+};
+vector < ActiveTile > activeTiles;
+
+// The run of activeTiles in each chunk of the level, with the box its tiles can take up
+// while drawn, so a chunk outside every view is culled without looking at its tiles
+struct BoardChunk {
+    size_t begin;
+    size_t end;
+    glm::vec3 lo;
+    glm::vec3 hi;
+    MeshHandle baked;       // every tile of the chunk at rest in one mesh, NULL until uploaded
+    glm::mat4 bakedWorld;   // places the baked mesh, whose positions are in tenths from the chunk's corner
+};
+vector < BoardChunk > boardChunks;
+
+// Next tile to rise or sink, and the rises or sinks played per tick : one on boards of up
+// to 400 tiles, more on larger ones so they take no longer than a full 20x20 board
+size_t boardCursor = 0;
+int boardSteps = 1;
+
+// Tiles raised or sunk by the last tick, the only ones whose snapshot is stale
+size_t movedBegin = 0, movedEnd = 0;
+
+// Baked board : once every tile is at rest each chunk is drawn from one mesh holding all of
+// its tiles, baked with the level off the render thread.  Faces a neighbouring tile covers are left
+// out; each bridge gets a fixed run of indices, its switch's bridges in a chunk side by side,
+// rewritten in place when the bridges rise or fall.  Cells are 3 x 3 x 1 tenths, so positions
+// within a chunk are small integers, 12 bytes a vertex
+struct BakedVertex {
+    GLshort position [ 4 ];     // tenths from the corner of the chunk, fourth component pads the colour
+    GLubyte color [ 4 ];
+};
 
-void Background ( ) 
-{   
-    GLfloat vertex_buffer_data [ ] = {
-        6,6,-6,
-        -6,6,-6,
-        -6,-6,-6,
+// The bridges of one switch within one chunk
+struct BakedRun {
+    size_t chunk;
+    int group;
+    GLintptr offset;                // bytes into the chunk's index buffer
+    vector < GLubyte > indices;     // as uploaded while the bridges are down
+};
 
-        -6,-6,-6,
-        6,-6,-6,
-        6,6,-6,
+const int bridge_run_indices = 36;      // every face of a bridge tile
 
-        6,-6,-6,
-        -6,-6,-6,
-        -6,-6,6,
+// A chunk's mesh as baked off the render thread, waiting to be uploaded
+struct BakedChunkData {
+    vector < BakedVertex > vertices;
+    vector < GLubyte > indices;     // index_size bytes each, those of bridges that are up zero
+    int indexSize;
+};
 
-        -6,-6,6,
-        6,-6,6,
-        6,-6,-6,
+int bakeBoard = 1;                      // 0 with --no-bake : the settled board is drawn tile by tile
+bool boardBaked = false;                // every chunk mesh of the level is on the GPU
+vector < BakedRun > bakedRuns;          // by switch, those of group g from bakedRunStart [ g ] to bakedRunStart [ g + 1 ]
+vector < size_t > bakedRunStart;
+vector < GLubyte > bakedRunUp;          // zeros, as long as the longest run : degenerate triangles for bridges that are up
+sim::BridgeMask bakedBridges;           // bridges down as the baked indices show them
+
+// Baked chunks still to reach the GPU, uploaded a slice a frame through one staging buffer :
+// chunk bakedUpload, uploadedBytes into its vertices then its indices
+const GLsizeiptr upload_budget = 256 * 1024;    // bytes staged per frame
+vector < BakedChunkData > bakedUploads;
+size_t bakedUpload = 0;
+GLsizeiptr uploadedBytes = 0;
+int uploadFrames = 0;
+BufferHandle stagingBuffer;
+
+// Meshes of the level just left; the tick that changes level issues no GL call, so they are
+// deleted on the next frame
+vector < MeshHandle > retiredMeshes;
+
+/* Hand the baked chunk meshes of the level being left over to be deleted on the next frame */
+void retireBakedBoard ( )
+{
+    for ( size_t c = 0; c < boardChunks.size ( ); c++ )
+        if ( boardChunks[ c ].baked )
+            retiredMeshes.push_back ( std::move ( boardChunks[ c ].baked ) );
+    bakedRuns.clear ( );
+    bakedRunStart.clear ( );
+    bakedUploads.clear ( );
+    boardBaked = false;
+}
 
-        -6,-6,-6,
-        -6,6,-6,
-        -6,6,6,
+MeshHandle instancedCell;
+int instanced = 0;
 
-        -6,6,6,
-        -6,-6,6,
-        -6,-6,-6,
+// Split screen : every camera mode at once, three views across the top of the window
+// and two across the bottom
+const int split_views = 5;         // also the size of viewProjections in Sample_GL_Split.geom
+int splitScreen = 0;
 
-        6,-6,-6,
-        6,6,-6,
-        6,6,6,
+/* Shared cell mesh for the instanced board : positions, face shade and a per tile instance buffer */
+MeshHandle createInstancedCell ( float l, float b, float h )
+{
+    GLfloat vertex_buffer_data [ 108 ];
+    GLfloat shade_buffer_data [ 36 ];
+    cellVertices ( l, b, h, vertex_buffer_data );
+
+    // faces 1 and 4, 2 and 5, 3 and 6 share a shade, as in createColor
+    for ( int v = 0; v < 36; v++ )
+        shade_buffer_data[ v ] = ( v / 6 ) % 3;
+
+    MeshHandle vao ( new VAO );
+    vao->PrimitiveMode = GL_TRIANGLES;
+    vao->NumVertices = 36;
+    vao->FillMode = GL_FILL;
+
+    glGenVertexArrays ( 1, &( vao->VertexArrayID ) );
+    glGenBuffers ( 1, &( vao->VertexBuffer ) );
+    glGenBuffers ( 1, &( vao->ColorBuffer ) );
+    glGenBuffers ( 1, &( vao->InstanceBuffer ) );
+    gpuStats.vertexArrays += 1;
+    gpuStats.buffers += 3;
+    profiler.count ( prof::COUNTER_OBJECTS, 4 );
+    tileInstanceBytes = tile_instance_reserve * sizeof ( TileInstance );
+    vao->Bytes = sizeof ( vertex_buffer_data ) + sizeof ( shade_buffer_data ) + tileInstanceBytes;
+    gpuStats.bytes += vao->Bytes;
+
+    bindVertexArray ( vao->VertexArrayID );
+
+    bindArrayBuffer ( vao->VertexBuffer );
+    glBufferData ( GL_ARRAY_BUFFER, sizeof ( vertex_buffer_data ), vertex_buffer_data, GL_STATIC_DRAW );
+    glVertexAttribPointer ( 0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0 );
+    glEnableVertexAttribArray ( 0 );
 
-        6,6,6,
-        6,-6,6,
-        6,-6,-6,
+    bindArrayBuffer ( vao->ColorBuffer );
+    glBufferData ( GL_ARRAY_BUFFER, sizeof ( shade_buffer_data ), shade_buffer_data, GL_STATIC_DRAW );
+    glVertexAttribPointer ( 1, 1, GL_FLOAT, GL_FALSE, 0, (void*)0 );
+    glEnableVertexAttribArray ( 1 );
 
-        6,6,6,
-        -6,6,6,
-        -6,-6,6,
+    bindArrayBuffer ( vao->InstanceBuffer );
+    glBufferData ( GL_ARRAY_BUFFER, tileInstanceBytes, NULL, GL_STREAM_DRAW );
+    glVertexAttribPointer ( 2, 3, GL_FLOAT, GL_FALSE, sizeof ( TileInstance ), (void*)0 );
+    glVertexAttribIPointer ( 3, 1, GL_UNSIGNED_BYTE, sizeof ( TileInstance ), (void*)( 3*sizeof(GLfloat) ) );
+    glVertexAttribPointer ( 4, 1, GL_UNSIGNED_BYTE, GL_TRUE, sizeof ( TileInstance ), (void*)( 3*sizeof(GLfloat) + 1 ) );
+    for ( int attribute = 2; attribute <= 4; attribute++ ) {
+        glEnableVertexAttribArray ( attribute );
+        glVertexAttribDivisor ( attribute, 1 );
+    }
 
-        -6,-6,6,
-        6,-6,6,
-        6,6,6
-    };
-    GLfloat color_buffer_data [ ] = {
-        0,0,0,
-        0,0,0,
-        0.6,0.6,1,
+    return vao;
+}
 
-        0.6,0.6,1,
+/* Build the shared material meshes once, before the first level is loaded */
+void createMaterialMeshes ( )
+{
+    for ( int p = 0; p < palette_size; p++ )
+        materialMeshes[ p ] = createCell ( 0.3f, 0.3f, -0.1f, paletteColors[ p ] );
+}
+
+/* Upload the palette to the instanced program, shade k of entry p taken from face k of its colour array */
+void loadPalette ( GLuint program )
+{
+    GLfloat palette [ 3 * palette_size * 3 ];
+    for ( int p = 0; p < palette_size; p++ )
+        for ( int k = 0; k < 3; k++ )
+            for ( int c = 0; c < 3; c++ )
+                palette[ 9*p + 3*k + c ] = paletteColors[ p ][ 18*k + c ];
+
+    useProgram ( program );
+    glUniform3fv ( glGetUniformLocation ( program, "palette" ), 3 * palette_size, palette );
+    profiler.count ( prof::COUNTER_UNIFORMS );
+}
+
+glm::vec3 eye; 
+glm::vec3 target;
+
+// GL_TIME_ELAPSED queries of the spans of the render queue drawn for each phase, and a
+// GL_SAMPLES_PASSED query of the fragments that got through the depth test in each frame, kept
+// a few frames deep so a result is only read once the GPU is done with it and reading never
+// stalls the pipeline
+const int gpu_query_frames = 4;
+const int gpu_spans_per_frame = 64;     // phase changes timed per frame, over every view
+
+struct GpuSpans {
+    GLuint queries [ gpu_spans_per_frame ];
+    prof::Phase phases [ gpu_spans_per_frame ];
+    int issued;
+    bool open;
+    bool overflowed;        // more spans than queries : the frame is not sampled
+} gpuSpans [ gpu_query_frames ];
+GLuint fragmentQueries [ gpu_query_frames ];
+bool fragmentQueryIssued [ gpu_query_frames ];
+long gpuFrame = 0;
+
+/* Time the draws from here to endGpuSpan on the GPU, as part of phase */
+void beginGpuSpan ( prof::Phase phase )
+{
+    if ( ! profiler.enabled )
+        return;
+    GpuSpans &spans = gpuSpans[ gpuFrame % gpu_query_frames ];
+    if ( spans.issued == gpu_spans_per_frame ) {
+        spans.overflowed = true;
+        return;
+    }
+    glBeginQuery ( GL_TIME_ELAPSED, spans.queries[ spans.issued ] );
+    spans.phases[ spans.issued++ ] = phase;
+    spans.open = true;
+}
+
+void endGpuSpan ( )
+{
+    GpuSpans &spans = gpuSpans[ gpuFrame % gpu_query_frames ];
+    if ( ! spans.open )
+        return;
+    glEndQuery ( GL_TIME_ELAPSED );
+    spans.open = false;
+}
+
+/* Count the fragments shaded from here to endFragmentCount, over every view of the frame */
+void beginFragmentCount ( )
+{
+    if ( ! profiler.enabled )
+        return;
+    glBeginQuery ( GL_SAMPLES_PASSED, fragmentQueries[ gpuFrame % gpu_query_frames ] );
+    fragmentQueryIssued[ gpuFrame % gpu_query_frames ] = true;
+}
+
+void endFragmentCount ( )
+{
+    if ( profiler.enabled )
+        glEndQuery ( GL_SAMPLES_PASSED );
+}
+
+/* Hand the GPU times of the spans in slot to the profiler, summed by phase, with their total
+   as the time of PHASE_SUBMIT; without wait a frame whose spans are not all done is dropped
+   rather than read, with it the call blocks, to drain the queries at the end of a run */
+void collectGpuPhases ( int slot, bool wait )
+{
+    GpuSpans &spans = gpuSpans[ slot ];
+    bool ready = ! spans.overflowed;
+    for ( int k = 0; ready && ! wait && k < spans.issued; k++ ) {
+        GLint available = 0;
+        glGetQueryObjectiv ( spans.queries[ k ], GL_QUERY_RESULT_AVAILABLE, &available );
+        ready = available;
+    }
+    if ( ready && spans.issued ) {
+        double ms [ prof::phase_count ] = { 0 };
+        bool timed [ prof::phase_count ] = { false };
+        for ( int k = 0; k < spans.issued; k++ ) {
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v ( spans.queries[ k ], GL_QUERY_RESULT, &nanoseconds );
+            ms[ spans.phases[ k ] ] += nanoseconds / 1e6;
+            ms[ prof::PHASE_SUBMIT ] += nanoseconds / 1e6;
+            timed[ spans.phases[ k ] ] = timed[ prof::PHASE_SUBMIT ] = true;
+        }
+        for ( int p = 0; p < prof::phase_count; p++ )
+            if ( timed[ p ] )
+                profiler.gpuSample ( ( prof::Phase ) p, ms[ p ] );
+    }
+    spans.issued = 0;
+    spans.overflowed = false;
+
+    if ( ! fragmentQueryIssued[ slot ] )
+        return;
+    GLint available = 0;
+    if ( ! wait ) {
+        glGetQueryObjectiv ( fragmentQueries[ slot ], GL_QUERY_RESULT_AVAILABLE, &available );
+        if ( ! available )
+            return;
+    }
+    GLuint64 fragments = 0;
+    glGetQueryObjectui64v ( fragmentQueries[ slot ], GL_QUERY_RESULT, &fragments );
+    profiler.fragmentSample ( fragments );
+    fragmentQueryIssued[ slot ] = false;
+}
+
+// Render queue : the draws of a scene are collected with a sort key and submitted in key order,
+// opaque meshes grouped by program and batch and front to back within them, so the depth test
+// rejects hidden fragments before they are shaded; the background, which fills every pixel the
+// rest leaves, goes last.  Key, high bits first : layer ( 4 ), program ( 12 ), batch ( 16 ), depth ( 32 )
+enum DrawLayer {
+    LAYER_OPAQUE,
+    LAYER_BACKGROUND
+};
+
+// Meshes drawn alike, kept together in the queue, roughly nearest the camera first ( the
+// background is alone in its layer ); tiles add their palette index, the one mesh all tiles of
+// it share.  A batch is not a mesh : every HUD digit and board chunk has its own vertex array,
+// bound for its draw whatever the order, so keying them apart by vertex array would only give
+// up drawing them nearest first
+enum DrawBatch {
+    BATCH_BACKGROUND,
+    BATCH_HUD,
+    BATCH_BLOCK,
+    BATCH_BOARD,            // baked chunks and the instanced board
+    BATCH_TILE
+};
+
+struct DrawItem {
+    GLuint program;
+    GLint matrixID;         // where MVP goes in program
+    const VAO *vao;
+    GLsizei instances;      // drawn instanced when not 0
+    glm::mat4 MVP;
+    prof::Phase phase;      // what its GPU time is counted as
+};
+
+struct DrawOrder {
+    uint64_t key;
+    uint32_t item;
+
+    bool operator < ( const DrawOrder &other ) const { return key < other.key; }
+};
+
+vector < DrawItem > renderQueue;
+vector < DrawOrder > renderOrder;
+
+/* Queue vao to be drawn with MVP by program; centre places it for the front to back order */
+void enqueueDraw ( DrawLayer layer, DrawBatch batch, GLuint program, GLint matrixID, const VAO *vao, const glm::mat4 &MVP,
+                   const glm::vec3 &centre, GLsizei instances = 0 )
+{
+    // squared distances are positive floats, whose bits sort in the same order as their values
+    glm::vec3 d = centre - eye;
+    float distance = glm::dot ( d, d );
+    uint32_t depth;
+    memcpy ( &depth, &distance, sizeof ( depth ) );
+
+    DrawOrder order = { ( uint64_t ) layer << 60 | ( uint64_t ) ( program & 0xFFF ) << 48 | ( uint64_t ) ( batch & 0xFFFF ) << 32 | depth,
+                        ( uint32_t ) renderQueue.size ( ) };
+    renderOrder.push_back ( order );
+    prof::Phase phase = batch == BATCH_BACKGROUND ? prof::PHASE_SUBMIT
+                      : batch == BATCH_HUD ? prof::PHASE_HUD
+                      : batch == BATCH_BLOCK ? prof::PHASE_BLOCK : prof::PHASE_BOARD;
+    DrawItem item = { program, matrixID, vao, instances, MVP, phase };
+    renderQueue.push_back ( item );
+}
+
+/* Draw the queue in key order and empty it.  An item the same as the one before it, in the
+   same place, is dropped, and the matrix is only uploaded when it changes within a program.
+   Each run of items of one phase is timed on the GPU as a span of that phase */
+void submitRenderQueue ( )
+{
+    std::sort ( renderOrder.begin ( ), renderOrder.end ( ) );
+    const DrawItem *previous = NULL;
+    for ( size_t k = 0; k < renderOrder.size ( ); k++ ) {
+        const DrawItem &item = renderQueue[ renderOrder[ k ].item ];
+        if ( k == 0 || renderQueue[ renderOrder[ k-1 ].item ].phase != item.phase ) {
+            endGpuSpan ( );
+            beginGpuSpan ( item.phase );
+        }
+        bool sameProgram = previous && previous->program == item.program && previous->matrixID == item.matrixID;
+        bool sameMatrix = sameProgram && previous->MVP == item.MVP;
+        if ( sameMatrix && previous->vao == item.vao && previous->instances == item.instances )
+            continue;
+
+        useProgram ( item.program );
+        if ( ! sameMatrix ) {
+            glUniformMatrix4fv ( item.matrixID, 1, GL_FALSE, &item.MVP[0][0] );
+            profiler.count ( prof::COUNTER_UNIFORMS );
+        }
+        if ( item.instances ) {
+            polygonMode ( item.vao->FillMode );
+            bindVertexArray ( item.vao->VertexArrayID );
+            glDrawArraysInstanced ( item.vao->PrimitiveMode, 0, item.vao->NumVertices, item.instances );
+            profiler.count ( prof::COUNTER_DRAWS );
+        }
+        else
+            draw3DObject ( item.vao );
+        previous = &item;
+    }
+    endGpuSpan ( );
+    renderQueue.clear ( );
+    renderOrder.clear ( );
+    useProgram ( programID );
+}
+
+// Levels are read from a pack, one at a time as they are reached
+sim::LevelPack levelPack;
+const char *levelPath = "levels.txt";
+string levelName;
+
+// Rules state of the current level; the block and tiles are drawn from it
+sim::Level simLevel;
+sim::State simState, nextState;
+
+// Sessions are recorded and replayed as the seed of the start heights plus every input,
+// stamped with the number of ticks run before it was applied
+uint64_t gameSeed = 1;
+sim::Random gameRandom;
+uint64_t gameTick = 0;
+replay::Recorder recorder;
+replay::Player player;
+bool fastReplay = false;
+double sessionStart;
+
+// The game advances in fixed ticks whatever the frame rate; frames drawn between
+// two ticks interpolate the block and tile heights and the roll angle
+const double tick_seconds = 1.0 / 60.0;
+const double max_frame_seconds = 0.25;     // longest stall caught up on, in ticks worth of time
+int swapInterval = 1;
+
+struct FrameTiming {
+    long ticks;
+    long frames;
+    double updateSeconds;
+    double renderSeconds;
+} frameTiming;
+
+float previous_theta = 0.0f;
+
+// Headless mode : an offscreen EGL context drawing into a framebuffer object, one tick
+// per frame, frame k drawn right after tick k, so runs and dumped frames are the same every time
+struct Headless {
+    bool enabled;
+    EGLDisplay display;
+    EGLContext context;
+    EGLSurface surface;
+    GLuint framebuffer, colorBuffer, depthBuffer;
+    int width, height;
+    long frame;
+    long frames;            // frames to render before exiting
+    string dumpPrefix;      // frames written as <prefix>NNNNN.ppm when not empty
+    int dumpEvery;
+} headless;
+
+/* Game clock : wall time in a window, ticks rendered so far when headless */
+double clockSeconds ( )
+{
+    return headless.enabled ? headless.frame * tick_seconds : glfwGetTime ( );
+}
+
+/* Wall time for the frame and tick costs, whichever clock drives the game */
+double wallSeconds ( )
+{
+    return chrono::duration < double > ( chrono::steady_clock::now ( ).time_since_epoch ( ) ).count ( );
+}
+
+float theta = 0.0f, 
+        z_ordinate = 0.0f, 
+        y_ordinate = 0.0f, 
+        x_ordinate = 0.0f,
+        camera_rotation_angle = 70.0f;
+
+int level = 1, stageStart = 1, 
+    presentState = 0, futureState = 0, direction = 5,
+    views = 4, moves = 0,
+    left_button = 0, right_button = 0;
+    
+double oldMousex, oldMousey;
+
+MeshHandle background;
+
+GraphicalObject Block;
+MeshHandle blockMesh;
+
+void Background ( ) 
+{   
+    GLfloat vertex_buffer_data [ ] = {
+        6,6,-6,
+        -6,6,-6,
+        -6,-6,-6,
+
+        -6,-6,-6,
+        6,-6,-6,
+        6,6,-6,
+
+        6,-6,-6,
+        -6,-6,-6,
+        -6,-6,6,
+
+        -6,-6,6,
+        6,-6,6,
+        6,-6,-6,
+
+        -6,-6,-6,
+        -6,6,-6,
+        -6,6,6,
+
+        -6,6,6,
+        -6,-6,6,
+        -6,-6,-6,
+
+        6,-6,-6,
+        6,6,-6,
+        6,6,6,
+
+        6,6,6,
+        6,-6,6,
+        6,-6,-6,
+
+        6,6,6,
+        -6,6,6,
+        -6,-6,6,
+
+        -6,-6,6,
+        6,-6,6,
+        6,6,6
+    };
+    GLfloat color_buffer_data [ ] = {
+        0,0,0,
+        0,0,0,
+        0.6,0.6,1,
+
+        0.6,0.6,1,
         1, 0.6, 0.8,
         0,0,0,
 
@@ -623,135 +1654,225 @@ void Background ( )
     background = create3DObject ( GL_TRIANGLES, 30, vertex_buffer_data, color_buffer_data, GL_FILL );
 }
 
-void renderscore(double x, double y, double z, int score)
-{
-  double x_ordinate = x, y_ordinate = y, z_ordinate = z;
-  glm::mat4 VP = ( perspective? Matrices.projectionP:Matrices.projectionO ) * Matrices.view;
-  glm::mat4 MVP;
-  glm::mat4 Irotator = glm::rotate(70.0f, glm::vec3(0,1,0));
-  glm::mat4 Itranslator = glm::translate(glm::vec3(0.1f,0,0));
-  glm::mat4 translator = glm::translate(glm::vec3(x_ordinate, y_ordinate, z_ordinate));
-  if(score == 0){
-    Matrices.model = glm::mat4(1.0f);
-    Matrices.model *= translator*Irotator*Itranslator;
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-    draw3DObject(create3DObject(GL_TRIANGLES, 6, digitopbar, darkyellow, GL_FILL));
-    draw3DObject(create3DObject(GL_TRIANGLES, 6, digitlefttopbar, darkyellow, GL_FILL));
-    draw3DObject(create3DObject(GL_TRIANGLES, 6, digitleftbotbar, darkyellow, GL_FILL));
-    draw3DObject(create3DObject(GL_TRIANGLES, 6, digitbotbar, darkyellow, GL_FILL));
-    draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrightbotbar, darkyellow, GL_FILL));
-    draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrighttopbar, darkyellow, GL_FILL));
-    return;
-  }
-  int tmp = score;
-  while(tmp != 0){
-    Matrices.model = glm::mat4(1.0f);
-    glm::mat4 translator = glm::translate(glm::vec3(x_ordinate, y_ordinate, 0));
-    switch(tmp%10){
-      case 0:
-        Matrices.model *= translator*Irotator*Itranslator;
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitlefttopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitleftbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrightbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrighttopbar, darkyellow, GL_FILL));
-        break;
-      case 1:
-        Matrices.model *= translator*Irotator*Itranslator;
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrightbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrighttopbar, darkyellow, GL_FILL));
-          break;
-      case 2:
-        Matrices.model *= translator*Irotator*Itranslator;
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrighttopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitmidbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitleftbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitbotbar, darkyellow, GL_FILL));
-          break;
-      case 3:
-        Matrices.model *= translator*Irotator*Itranslator;
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrightbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrighttopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitmidbar, darkyellow, GL_FILL));
-        break;
-      case 4:
-        Matrices.model *= translator*Irotator*Itranslator;
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitlefttopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrightbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrighttopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitmidbar, darkyellow, GL_FILL));
-        break;
-      case 5:
-        Matrices.model *= translator*Irotator*Itranslator;
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitlefttopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitmidbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrightbotbar, darkyellow, GL_FILL));
-        break;
-      case 6:
-        Matrices.model *= translator*Irotator*Itranslator;
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitlefttopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitmidbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitleftbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrightbotbar, darkyellow, GL_FILL));
-        break;
-      case 7:
-        Matrices.model *= translator*Irotator*Itranslator;
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrightbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrighttopbar, darkyellow, GL_FILL));
-        break;
-      case 8:
-        Matrices.model *= translator*Irotator*Itranslator;
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitlefttopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitleftbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrightbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrighttopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitmidbar, darkyellow, GL_FILL));
-        break;
-      case 9:
-        Matrices.model *= translator*Irotator*Itranslator;
-        MVP = VP * Matrices.model;
-        glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitlefttopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrightbotbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitrighttopbar, darkyellow, GL_FILL));
-        draw3DObject(create3DObject(GL_TRIANGLES, 6, digitmidbar, darkyellow, GL_FILL));
-        break;
-    }
-    tmp = tmp/10;
-    x_ordinate -= 0.3;
-  }
+// Segments lit for each decimal digit, in digitSegments order
+// ( top, mid, bot, lefttop, leftbot, righttop, rightbot )
+static const int digitMask [ 10 ] = {
+    0x7D, 0x60, 0x37, 0x67, 0x6A, 0x4F, 0x5F, 0x61, 0x7F, 0x6F
+};
+
+GLfloat *digitSegments [ 7 ] = {
+    digitopbar, digitmidbar, digitbotbar,
+    digitlefttopbar, digitleftbotbar,
+    digitrighttopbar, digitrightbotbar
+};
+
+static const int hud_max_digits = 10;
+static const int hud_segment_vertices = 6;
+
+/* A number shown on the HUD : one persistent mesh, re-baked only when the value changes */
+struct HudNumber {
+    MeshHandle object;
+    float x_ordinate;
+    float y_ordinate;
+    float z_ordinate;
+    int value;
+};
+
+HudNumber levelHud, timeHud, movesHud;
+
+/* Allocate the vertex storage for a HUD number once, sized for hud_max_digits digits */
+HudNumber createHudNumber ( float x, float y, float z )
+{
+    HudNumber hud;
+    hud.x_ordinate = x;
+    hud.y_ordinate = y;
+    hud.z_ordinate = z;
+    hud.value = -1;
+
+    int capacity = hud_max_digits * 7 * hud_segment_vertices;
+    vector < GLfloat > color_buffer_data ( 3 * capacity );
+    for ( int i = 0; i < capacity; i++ )
+        for ( int k = 0; k < 3; k++ )
+            color_buffer_data[ 3*i + k ] = darkyellow[ k ];
+
+    hud.object = create3DObject ( GL_TRIANGLES, capacity, NULL, &color_buffer_data[0], GL_FILL );
+    hud.object->NumVertices = 0;
+
+    // positions are rewritten whenever the value changes
+    bindArrayBuffer ( hud.object->VertexBuffer );
+    glBufferData ( GL_ARRAY_BUFFER, 3*capacity*sizeof(GLfloat), NULL, GL_DYNAMIC_DRAW );
+    return hud;
+}
+
+/* Rebuild the world space segment geometry of every digit of score into the HUD mesh */
+void bakeHudNumber ( HudNumber &hud, int score )
+{
+    GLfloat vertex_buffer_data [ hud_max_digits * 7 * hud_segment_vertices * 3 ];
+    int numVertices = 0;
+
+    glm::mat4 Irotator = glm::rotate ( 70.0f, glm::vec3 ( 0, 1, 0 ) );
+    glm::mat4 Itranslator = glm::translate ( glm::vec3 ( 0.1f, 0, 0 ) );
+
+    int tmp = score, digit = 0;
+    do {
+        glm::mat4 translator = glm::translate ( glm::vec3 ( hud.x_ordinate - 0.3f*digit, hud.y_ordinate, hud.z_ordinate ) );
+        glm::mat4 model = translator*Irotator*Itranslator;
+        int mask = digitMask[ tmp % 10 ];
+        for ( int s = 0; s < 7; s++ ) {
+            if ( ! ( mask & ( 1 << s ) ) )
+                continue;
+            for ( int v = 0; v < hud_segment_vertices; v++ ) {
+                GLfloat *p = &digitSegments[ s ][ 3*v ];
+                glm::vec4 w = model * glm::vec4 ( p[0], p[1], p[2], 1.0f );
+                vertex_buffer_data[ 3*numVertices ] = w.x;
+                vertex_buffer_data[ 3*numVertices + 1 ] = w.y;
+                vertex_buffer_data[ 3*numVertices + 2 ] = w.z;
+                numVertices++;
+            }
+        }
+        tmp = tmp / 10;
+        digit++;
+    } while ( tmp != 0 && digit < hud_max_digits );
+
+    bindArrayBuffer ( hud.object->VertexBuffer );
+    glBufferSubData ( GL_ARRAY_BUFFER, 0, 3*numVertices*sizeof(GLfloat), vertex_buffer_data );
+    profiler.count ( prof::COUNTER_UPLOADED, 3*numVertices*sizeof(GLfloat) );
+    hud.object->NumVertices = numVertices;
+    hud.value = score;
+}
+
+/* Queue a HUD number as a single draw, re-uploading only if score changed */
+void renderscore ( HudNumber &hud, int score )
+{
+    if ( score != hud.value )
+        bakeHudNumber ( hud, score );
+
+    // segment vertices are already in world space
+    enqueueDraw ( LAYER_OPAQUE, BATCH_HUD, programID, Matrices.MatrixID, hud.object.get ( ), Matrices.VP,
+                  glm::vec3 ( hud.x_ordinate, hud.y_ordinate, hud.z_ordinate ) );
+}
+
+/* Tear the HUD down, deleting its meshes */
+void releaseHud ( )
+{
+    levelHud.object.reset ( );
+    timeHud.object.reset ( );
+    movesHud.object.reset ( );
+}
+
+/* Delete every GL object the game owns while the context is still current, then report any the
+   counts still hold : those leaked.  Does nothing for what was never created */
+void releaseGLResources ( )
+{
+    retireBakedBoard ( );
+    retiredMeshes.clear ( );
+    releaseHud ( );
+    for ( int p = 0; p < palette_size; p++ )
+        materialMeshes[ p ].reset ( );
+    blockMesh.reset ( );
+    background.reset ( );
+    instancedCell.reset ( );
+    stagingBuffer.reset ( );
+    shaderPrograms.clear ( );
+
+    if ( gpuStats.vertexArrays || gpuStats.buffers || gpuStats.programs || gpuStats.bytes )
+        fprintf ( stderr, "GL resources : %d vertex arrays, %d buffers, %d programs and %ld bytes never freed\n",
+                  gpuStats.vertexArrays, gpuStats.buffers, gpuStats.programs, gpuStats.bytes );
+}
+
+void quit ( GLFWwindow *window )
+{
+    releaseGLResources ( );
+    // headless runs have no window
+    if ( window )
+        glfwDestroyWindow ( window );
+    glfwTerminate ( );
+    exit ( EXIT_SUCCESS );
+}
+
+// Sound effects, mixed on the audio thread
+audio::Engine audioEngine;
+int moveSound = -1;
+
+/* Decode the sound effects and start the mixer on sink : "alsa", "null" or "wav:<file>";
+   without a usable sound card the game carries on silently */
+void initAudio ( const string &sinkName )
+{
+    audio::Sound sound;
+    string error;
+    // the first 30 frames of the clip, as much as was ever played per move
+    if ( ! audio::decodeMp3 ( "movement.mp4", 30, sound, error ) ) {
+        fprintf ( stderr, "Audio : %s, playing without sound\n", error.c_str ( ) );
+        return;
+    }
+    moveSound = audioEngine.load ( sound );
+
+    std::unique_ptr < audio::Sink > sink;
+    if ( sinkName == "null" )
+        sink.reset ( new audio::NullSink ( ) );
+    else if ( sinkName.compare ( 0, 4, "wav:" ) == 0 )
+        sink.reset ( new audio::WavSink ( sinkName.substr ( 4 ) ) );
+    else
+        sink.reset ( new audio::AlsaSink ( ) );
+
+    if ( ! audioEngine.start ( std::move ( sink ), sound.rate, sound.channels ) ) {
+        fprintf ( stderr, "Audio : cannot open the %s sink, playing without sound\n", sinkName.c_str ( ) );
+        audioEngine.start ( std::unique_ptr < audio::Sink > ( new audio::NullSink ( ) ), sound.rate, sound.channels );
+    }
+}
+
+/* Start rolling the block : the move is resolved by the simulation now and committed when the roll ends */
+void moveBlock ( sim::Move move, int dir )
+{
+    if ( stageStart || direction != 5 || sim::evaluate ( simLevel, simState ) != sim::OUTCOME_OK )
+        return;
+
+    sim::step ( simLevel, simState, move, nextState );
+    futureState = nextState.orientation;
+    direction = dir;
+    moves++;
+    audioEngine.play ( moveSound );
+}
+
+/* Act on an input, live or replayed, and add it to the recording */
+void applyInput ( replay::Input input )
+{
+    recorder.record ( gameTick, input );
+    switch ( input ) {
+        case replay::INPUT_UP:
+            moveBlock ( sim::MOVE_UP, 8 );
+            break;
+        case replay::INPUT_DOWN:
+            moveBlock ( sim::MOVE_DOWN, 2 );
+            break;
+        case replay::INPUT_LEFT:
+            moveBlock ( sim::MOVE_LEFT, 4 );
+            break;
+        case replay::INPUT_RIGHT:
+            moveBlock ( sim::MOVE_RIGHT, 6 );
+            break;
+        case replay::INPUT_VIEW:
+            views = ( views + 1 ) % 5;
+            break;
+        case replay::INPUT_INSTANCED:
+            instanced = ! instanced;
+            break;
+        case replay::INPUT_SPLIT:
+            splitScreen = ! splitScreen;
+            break;
+        case replay::INPUT_PERSPECTIVE:
+            perspective = ! perspective;
+            break;
+        default:
+            break;
+    }
+}
+
+/* A key from the player; while a session is replaying the log has the controls */
+void userInput ( replay::Input input )
+{
+    if ( ! player.active )
+        applyInput ( input );
 }
 
 void keyboard ( GLFWwindow* window, int key, int scancode, int action, int mods )
@@ -767,70 +1888,35 @@ void keyboard ( GLFWwindow* window, int key, int scancode, int action, int mods
    else if ( action == GLFW_PRESS ) {
     switch ( key ) {
         case GLFW_KEY_V:
-            views = ( views + 1 ) % 5;
+            userInput ( replay::INPUT_VIEW );
+            break;
+
+        case GLFW_KEY_I:
+            userInput ( replay::INPUT_INSTANCED );
+            break;
+
+        case GLFW_KEY_M:
+            userInput ( replay::INPUT_SPLIT );
             break;
 
         case GLFW_KEY_P:
-            if ( perspective == 1 )
-                perspective = 0;
-            else 
-                perspective = 1;
+            userInput ( replay::INPUT_PERSPECTIVE );
             break;
 
          case GLFW_KEY_UP:    
-            if ( ! stageStart ) {
-                if ( presentState == 0 )
-                    futureState = 1;
-                else if ( presentState == 1 ) 
-                    futureState = 0;
-                else
-                    futureState = 2;
-                direction = 8;
-                moves++;
-                system("mpg123 -n 30 -i -q movement.mp4 &");
-            }
+            userInput ( replay::INPUT_UP );
             break;
             
          case GLFW_KEY_DOWN:
-            if ( ! stageStart ) {
-                if ( presentState == 0 )
-                    futureState = 1;
-                else if ( presentState == 1 ) 
-                    futureState = 0;
-                else if ( presentState == 2 )
-                    futureState = 2;
-                direction = 2;
-                moves++;
-                system("mpg123 -n 30 -i -q movement.mp4 &");
-            }
+            userInput ( replay::INPUT_DOWN );
             break;
                
          case GLFW_KEY_LEFT:
-            if ( ! stageStart ) {
-                if ( presentState == 0 )
-                    futureState = 2;
-                else if ( presentState == 1 ) 
-                    futureState = 1;
-                else if ( presentState == 2 )
-                    futureState = 0;
-                direction = 4;
-                moves++;
-                system("mpg123 -n 30 -i -q movement.mp4 &");
-            }
+            userInput ( replay::INPUT_LEFT );
             break;
         
          case GLFW_KEY_RIGHT:
-            if ( ! stageStart ) {
-                if ( presentState == 0 )
-                    futureState = 2;
-                else if ( presentState == 1 ) 
-                    futureState = 1;
-                else if ( presentState == 2 )
-                    futureState = 0;
-                direction = 6;
-                moves++;
-                system("mpg123 -n 30 -i -q movement.mp4 &");
-            }
+            userInput ( replay::INPUT_RIGHT );
             break;
     
          case GLFW_KEY_ESCAPE:
@@ -885,109 +1971,87 @@ void mouseButton ( GLFWwindow* window, int button, int action, int mods )
     }
 }
 
-void blockRotator ( )
+/* Advance the roll by one tick; once it is over the block rests where the simulation put it */
+void rollBlock ( )
 {    
     if ( theta < 90 && direction != 5 )
         theta += 10;
     else
     {
-        if ( presentState != futureState || direction != 5) {
-            if ( presentState == 0 ){
-                if ( direction == 8) 
-                    Block.z_ordinate -= Block.height;
-                else if ( direction == 2 ) 
-                    Block.z_ordinate += Block.length;
-                else if ( direction == 4 ) 
-                    Block.x_ordinate -= Block.height;
-                else 
-                    Block.x_ordinate += Block.length;
-            }
-            else if ( presentState == 1 ) {
-                if ( direction == 8) 
-                    Block.z_ordinate -= Block.length;
-                else if ( direction == 2 ) 
-                    Block.z_ordinate += Block.height;
-                else if ( direction == 4 ) 
-                    Block.x_ordinate -= Block.length;
-                else 
-                    Block.x_ordinate += Block.length;
-            }
-            else {
-                if ( direction == 8) 
-                    Block.z_ordinate -= Block.length;
-                else if ( direction == 2 ) 
-                    Block.z_ordinate += Block.length;
-                else if ( direction == 4 ) 
-                    Block.x_ordinate -= Block.length;
-                else 
-                    Block.x_ordinate += Block.height;
-            }
+        if ( direction != 5 ) {
+            simState = nextState;
+            Block.x_ordinate = simState.col * 0.3f;
+            Block.z_ordinate = simState.row * 0.3f;
         }
-        presentState = futureState;
-        theta = 0;
+        presentState = simState.orientation;
+        theta = previous_theta = 0;
         direction = 5;
     }
+}
 
+/* Block matrices for a roll of angle degrees with the block at the given height */
+void placeBlock ( float angle, float height )
+{
     if ( presentState == 0 ) {
         if ( direction == 6 ) {
             Block.Irotator ( );
             Block.Itranslator ( -Block.length, 0 , 0 );
-            Block.rotator ( -theta, glm::vec3 ( 0, 0, 1) );
-            Block.translator ( Block.x_ordinate+Block.length - 1, Block.y_ordinate, Block.z_ordinate - 1 );   
+            Block.rotator ( -angle, glm::vec3 ( 0, 0, 1) );
+            Block.translator ( Block.x_ordinate+Block.length - 1, height, Block.z_ordinate - 1 );   
         }
         else if ( direction == 4 ) {
             Block.Irotator ( );
             Block.Itranslator ( );
-            Block.rotator ( theta, glm::vec3 ( 0, 0, 1 ) ); 
-            Block.translator ( Block.x_ordinate - 1, Block.y_ordinate, Block.z_ordinate - 1);
+            Block.rotator ( angle, glm::vec3 ( 0, 0, 1 ) ); 
+            Block.translator ( Block.x_ordinate - 1, height, Block.z_ordinate - 1);
         }
         else if ( direction == 8 ) {
             Block.Irotator ( );
             Block.Itranslator ( );
-            Block.rotator ( -theta, glm::vec3 ( 1, 0, 0 ) );
-            Block.translator ( Block.x_ordinate - 1, Block.y_ordinate, Block.z_ordinate - 1);
+            Block.rotator ( -angle, glm::vec3 ( 1, 0, 0 ) );
+            Block.translator ( Block.x_ordinate - 1, height, Block.z_ordinate - 1);
         }
         else if ( direction == 2 ) {
             Block.Irotator ( );
             Block.Itranslator ( 0, 0, -Block.length );
-            Block.rotator ( theta, glm::vec3 ( 1, 0, 0 ) );
-            Block.translator ( Block.x_ordinate - 1, Block.y_ordinate, Block.z_ordinate + Block.length - 1);
+            Block.rotator ( angle, glm::vec3 ( 1, 0, 0 ) );
+            Block.translator ( Block.x_ordinate - 1, height, Block.z_ordinate + Block.length - 1);
         }
         else {
             Block.Irotator ( );
             Block.Itranslator ( );
             Block.rotator ( );
-            Block.translator ( Block.x_ordinate - 1, Block.y_ordinate, Block.z_ordinate - 1 );
+            Block.translator ( Block.x_ordinate - 1, height, Block.z_ordinate - 1 );
         }
     }
     else if ( presentState == 1 ) {
         if ( direction == 6 ) {
             Block.Irotator ( -90, glm::vec3 ( 1, 0, 0 ) );
             Block.Itranslator ( -Block.length, 0, 0 );
-            Block.rotator ( -theta, glm::vec3 ( 0, 0, 1) );
-            Block.translator ( Block.x_ordinate + Block.length - 1, Block.y_ordinate, Block.z_ordinate + Block.height - 1 );
+            Block.rotator ( -angle, glm::vec3 ( 0, 0, 1) );
+            Block.translator ( Block.x_ordinate + Block.length - 1, height, Block.z_ordinate + Block.height - 1 );
         }
         else if ( direction == 4 ) {
             Block.Irotator ( -90, glm::vec3 ( 1, 0, 0 ) );
             Block.Itranslator ( );
-            Block.rotator ( theta, glm::vec3 ( 0, 0, 1) );
-            Block.translator ( Block.x_ordinate - 1, Block.y_ordinate, Block.z_ordinate + Block.height - 1);
+            Block.rotator ( angle, glm::vec3 ( 0, 0, 1) );
+            Block.translator ( Block.x_ordinate - 1, height, Block.z_ordinate + Block.height - 1);
         }
         else if ( direction == 8 ) {
             Block.Irotator ( -90, glm::vec3 ( 1, 0, 0 ) );
             Block.Itranslator ( 0, 0, Block.height );
-            Block.rotator ( -theta, glm::vec3 (1, 0, 0 ) );
-            Block.translator ( Block.x_ordinate - 1, Block.y_ordinate, Block.z_ordinate - 1);
+            Block.rotator ( -angle, glm::vec3 (1, 0, 0 ) );
+            Block.translator ( Block.x_ordinate - 1, height, Block.z_ordinate - 1);
         }
         else if ( direction == 2 ) {
             Block.Irotator ( -90, glm::vec3 ( 1, 0, 0 ) );
             Block.Itranslator ( );
-            Block.rotator ( theta, glm::vec3 (1, 0, 0 ) );
-            Block.translator ( Block.x_ordinate - 1, Block.y_ordinate, Block.z_ordinate + Block.height - 1);
+            Block.rotator ( angle, glm::vec3 (1, 0, 0 ) );
+            Block.translator ( Block.x_ordinate - 1, height, Block.z_ordinate + Block.height - 1);
         }
         else {
             Block.Irotator ( -90, glm::vec3 ( 1, 0, 0 ) );
-            Block.Itranslator ( Block.x_ordinate - 1, Block.y_ordinate, Block.z_ordinate + Block.height - 1); 
+            Block.Itranslator ( Block.x_ordinate - 1, height, Block.z_ordinate + Block.height - 1); 
             Block.rotator ( );
             Block.translator ( );
         }
@@ -996,252 +2060,648 @@ void blockRotator ( )
         if ( direction == 6 ) {
             Block.Irotator ( 90, glm::vec3 ( 0, 0, 1 ) );
             Block.Itranslator ( );
-            Block.rotator ( -theta, glm::vec3 (0, 0, 1) );
-            Block.translator ( Block.x_ordinate + Block.height - 1, Block.y_ordinate, Block.z_ordinate - 1);
+            Block.rotator ( -angle, glm::vec3 (0, 0, 1) );
+            Block.translator ( Block.x_ordinate + Block.height - 1, height, Block.z_ordinate - 1);
         }
         else if ( direction == 4 ) {
             Block.Irotator ( 90, glm::vec3 ( 0, 0, 1 ) );
             Block.Itranslator ( Block.height, 0 , 0 );
-            Block.rotator ( theta, glm::vec3 ( 0, 0, 1 ) );
-            Block.translator ( Block.x_ordinate - 1, Block.y_ordinate, Block.z_ordinate - 1);
+            Block.rotator ( angle, glm::vec3 ( 0, 0, 1 ) );
+            Block.translator ( Block.x_ordinate - 1, height, Block.z_ordinate - 1);
         }
         else if ( direction == 8 ) {
             Block.Irotator ( 90, glm::vec3 ( 0, 0, 1 ) );
             Block.Itranslator ( );
-            Block.rotator ( -theta, glm::vec3 ( 1, 0, 0 ) );
-            Block.translator ( Block.x_ordinate + Block.height - 1, Block.y_ordinate, Block.z_ordinate - 1);
+            Block.rotator ( -angle, glm::vec3 ( 1, 0, 0 ) );
+            Block.translator ( Block.x_ordinate + Block.height - 1, height, Block.z_ordinate - 1);
         }
         else if ( direction == 2 ) {
             Block.Irotator ( 90, glm::vec3 ( 0, 0, 1 ) );
             Block.Itranslator ( 0, 0, -Block.length );
-            Block.rotator ( theta, glm::vec3 ( 1, 0, 0 ) );
-            Block.translator ( Block.x_ordinate + Block.height - 1, Block.y_ordinate, Block.z_ordinate + Block.length - 1);
+            Block.rotator ( angle, glm::vec3 ( 1, 0, 0 ) );
+            Block.translator ( Block.x_ordinate + Block.height - 1, height, Block.z_ordinate + Block.length - 1);
         }
         else {
             Block.Irotator ( );
             Block.Itranslator ( );
             Block.rotator ( 90, glm::vec3 ( 0, 0, 1 ) );
-            Block.translator ( Block.x_ordinate + Block.height - 1, Block.y_ordinate, Block.z_ordinate - 1 );
+            Block.translator ( Block.x_ordinate + Block.height - 1, height, Block.z_ordinate - 1 );
         }
     }
 }
 
-void bridgeConstruct ( )
+/* Palette entry of a tile of kind v at row i, column j */
+int tilePalette ( int v, int i, int j )
 {
-    vector < int > v;
-    
-    for ( map < int, vector< int > >::iterator it = bridgeMap.begin ( ); it != bridgeMap.end ( ); it++ ) {
-        vector < int > V = bridgeMap[it->first];
-        for ( int i = 0; i < board_size; i++ ) {
-            for ( int j = 0; j < board_size; j++ ) {
-                if ( board[ i ][ j ] == it->first ) {  
-                    for ( int i = 0; i < 4; i += 2 )
-                        board[ V [ i ] ][ V [ i + 1 ] ] = 7;
-
-                    bridge[ it->first ] = 0;
-                    prevBridge[ it->first ] = 1;
-                }
-            }
-        }
-    }
-    // Bridge 1
-    v.push_back(3);
-    v.push_back(4);
-    v.push_back(3);
-    v.push_back(5);
-    bridgeMap.insert ( make_pair ( 4, v) );
-    v.clear ( );
+    if ( v == sim::TILE_FLOOR )
+        return ( i + j ) % 2 == 0 ? PALETTE_GREY : PALETTE_WHITE;
+    if ( v == sim::TILE_FRAGILE )
+        return ( i + j ) % 2 == 0 ? PALETTE_ORANGE : PALETTE_DORANGE;
+    // toggle switches and bridges are green, on switches violet and off switches red
+    if ( v == sim::TILE_SWITCH_ON )
+        return PALETTE_VIOLET;
+    if ( v == sim::TILE_SWITCH_OFF )
+        return PALETTE_RED;
+    return PALETTE_GREEN;
+}
 
-    // Bridge 2
-    v.push_back(3);
-    v.push_back(10);
-    v.push_back(3);
-    v.push_back(11);
-    bridgeMap.insert ( make_pair ( 5, v ) );
-    v.clear ( );
+/* Does the cell hold a tile at all ( the goal is a hole ) */
+bool tileExists ( int i, int j )
+{
+    int t = simLevel.tile ( i, j );
+    return t != sim::TILE_EMPTY && t != sim::TILE_GOAL;
 }
 
-void levelup ( )
+/* Is the tile drawn : anything but the goal, bridges only while down */
+bool tileVisible ( int i, int j )
 {
-    level++;
-    switch ( level ) {
-        case 2:
-            for ( int i = 0; i < board_size; i++ )
-                for ( int j = 0; j < board_size; j++ )
-                    board[ i ][ j ] = stage2[ i ][ j ];
-            break;
-        case 3:
-            for ( int i = 0; i < board_size; i++ )
-                for ( int j = 0; j < board_size; j++ )
-                    board[ i ][ j ] = stage3[ i ][ j ];
-            break;
-        default:
-            quit ( window );
-            break;
-    };
+    return tileExists ( i, j ) && ( simLevel.tile ( i, j ) != sim::TILE_BRIDGE || sim::bridgeDown ( simLevel, simState, i, j ) );
+}
 
-    z_ordinate = 0.0f;
-    for ( int i = 0; i < board_size; i++ ) {
-            VAO *cell;
-            GraphicalObject temp;
-             x_ordinate = 0.0f;
-            for ( int j = 0; j < board_size; j++ ) {
-                y_ordinate = rand ( ) % 2 - 6.0f;
-                if ( board[ i ][ j ] == 1) {
-                    if ( ( i + j ) % 2 == 0 ) {
-                        cell = createCell ( 0.3f, 0.3f, -0.1f, Grey );
-                        temp = GraphicalObject ( x_ordinate, y_ordinate, z_ordinate, 0.1f, 0.3f, 'r' );
-                    }
-                    else {
-                        cell = createCell ( 0.3f, 0.3f, -0.1f, White );
-                        temp = GraphicalObject ( x_ordinate, y_ordinate, z_ordinate, 0.1f, 0.3f,  'g' );
-                    }
-                }
-                else if ( board[ i ][ j ] == 3 ) {
-                    if ( ( i + j ) % 2 == 0 ) {
-                        cell = createCell ( 0.3f, 0.3f, -0.1f,  Orange);
-                        temp = GraphicalObject ( x_ordinate, y_ordinate, z_ordinate, 0.1f, 0.3f,  'b' );
-                    }
-                    else {
-                        cell = createCell ( 0.3f, 0.3f, -0.1f,  Dorange );
-                        temp = GraphicalObject ( x_ordinate, y_ordinate, z_ordinate, 0.1f, 0.3f,  'b' );   
-                    }
-                }
-                else {
-                    cell = createCell ( 0.3f, 0.3f, -0.1f,  Green);
-                    temp = GraphicalObject ( x_ordinate, y_ordinate, z_ordinate, 0.1f, 0.3f,  'b' );   
-                }
-                temp.object = cell;
-                Board[ i ][ j ] = temp;
-                x_ordinate += 0.3f;
-            }
-            z_ordinate += 0.3f;
-        }
-        bridgeConstruct ( );
+// Planes of the view frustums of the cameras being drawn, as ( a, b, c, d ) with
+// a*x + b*y + c*z + d >= 0 inside, taken from the rows of VP ( Gribb and Hartmann )
+float frustumPlanes [ split_views ][ 6 ][ 4 ];
+int frustumCount = 0;
+
+/* Planes of VP into frustum slot f */
+void extractFrustum ( int f, const glm::mat4 &VP )
+{
+    for ( int p = 0; p < 6; p++ ) {
+        int axis = p / 2;
+        float sign = ( p % 2 ) ? -1.0f : 1.0f;
+        for ( int c = 0; c < 4; c++ )
+            frustumPlanes[ f ][ p ][ c ] = VP[ c ][ 3 ] + sign * VP[ c ][ axis ];
+    }
 }
 
-void drawBoard ( )
+/* Is any of the box between lo and hi inside any of the frustums; only the corner furthest
+   along each plane normal is tested, so boxes near a frustum corner may pass */
+bool boxInFrustum ( glm::vec3 lo, glm::vec3 hi )
 {
-    for ( int i = 0; i < board_size; i++ ) {
-        for ( int j = 0; j < board_size; j++ ) {
-            Board[ i ][ j ].translator ( Board[ i ][ j ].x_ordinate - 1,
-                                                        Board[ i ][ j ].y_ordinate,
-                                                        Board[ i ][ j ].z_ordinate - 1);   
-            if ( board[ i ][ j ] != 0 && board[ i ][ j ] != 2 && board[ i ][ j ] != 7 && Board[ i ][ j ].y_ordinate > -4.0f)
-                Board[ i ][ j ].render ( );
+    for ( int f = 0; f < frustumCount; f++ ) {
+        bool inside = true;
+        for ( int p = 0; p < 6 && inside; p++ ) {
+            const float *plane = frustumPlanes[ f ][ p ];
+            float x = plane[ 0 ] >= 0 ? hi.x : lo.x;
+            float y = plane[ 1 ] >= 0 ? hi.y : lo.y;
+            float z = plane[ 2 ] >= 0 ? hi.z : lo.z;
+            inside = plane[ 0 ]*x + plane[ 1 ]*y + plane[ 2 ]*z + plane[ 3 ] >= 0;
         }
+        if ( inside )
+            return true;
     }
+    return false;
 }
 
-void fallBlocksBoards ( )
+/* Is any tile of the chunk inside any of the frustums; the tiles of one that is not count as culled */
+bool chunkOnScreen ( const BoardChunk &chunk )
 {
-    if ( Block.y_ordinate > -6.0f ) {
-            Block.y_ordinate -= 0.1f;
-            Block.translator ( Block.x_ordinate - 1, Block.y_ordinate, Block.z_ordinate - 1 );   
-            return;
-        }
-    for ( int i = 0; i < board_size; i++) {
-            for (int j = 0; j < board_size; j++ ) {
-                  if ( Board[ i ][ j ].y_ordinate >= -5.0f && 
-                        board[ i ][ j ] != 0 &&
-                        board[ i ][ j ] != 2 ) {
-                        Board[ i ][ j ].y_ordinate -= 1.0f;
-                        return;
-                    }
-                }   
-            }
-    stageStart = 1;
+    if ( boxInFrustum ( chunk.lo, chunk.hi ) )
+        return true;
+    profiler.count ( prof::COUNTER_CULLED, chunk.end - chunk.begin );
+    return false;
 }
 
-void buildBlocksBoards ( )
+/* Does the tile, drawn at height y, need to be submitted for this view */
+bool tileOnScreen ( const ActiveTile &tile, float y )
 {
-    for ( int i = 0; i < board_size; i++) {
-        for (int j = 0; j < board_size; j++ ) {
-            if ( Board[ i ][ j ].y_ordinate < -0.1f && 
-                board[ i ][ j ] != 0 && 
-                board[ i ][ j ] != 2 ) {
-                Board[ i ][ j ].y_ordinate += 1.0f;
-                return;
-            }
+    if ( ! tileVisible ( tile.row, tile.col ) || tile.y_ordinate <= -4.0f )
+        return false;
+    // the cell mesh spans 0.3 along x and z and sinks 0.1 below its origin
+    glm::vec3 lo ( tile.col * 0.3f - 1, y - 0.1f, tile.row * 0.3f - 1 );
+    if ( boxInFrustum ( lo, lo + glm::vec3 ( 0.3f, 0.1f, 0.3f ) ) )
+        return true;
+    profiler.count ( prof::COUNTER_CULLED );
+    return false;
+}
+
+/* Submit every tile in view with a single instanced draw call */
+void drawBoardInstanced ( float alpha )
+{
+    int count = 0;
+    for ( size_t c = 0; c < boardChunks.size ( ); c++ ) {
+        if ( ! chunkOnScreen ( boardChunks[ c ] ) )
+            continue;
+        for ( size_t t = boardChunks[ c ].begin; t < boardChunks[ c ].end; t++ ) {
+            const ActiveTile &board = activeTiles[ t ];
+            float y = board.interpolatedY ( alpha );
+            if ( ! tileOnScreen ( board, y ) )
+                continue;
+            TileInstance &tile = tileInstances[ count++ ];
+            tile.x_ordinate = board.col * 0.3f - 1;
+            tile.y_ordinate = y;
+            tile.z_ordinate = board.row * 0.3f - 1;
+            tile.palette = board.palette;
+            tile.visible = 255;
         }
     }
-    stageStart = 0;
+    if ( count == 0 )
+        return;
+
+    bindArrayBuffer ( instancedCell->InstanceBuffer );
+    GLsizeiptr bytes = count * sizeof ( TileInstance );
+    if ( bytes > tileInstanceBytes ) {
+        // orphan the buffer for one large enough to hold every tile of the level
+        GLsizeiptr grown = std::max ( bytes, ( GLsizeiptr ) ( tileInstances.size ( ) * sizeof ( TileInstance ) ) );
+        glBufferData ( GL_ARRAY_BUFFER, grown, NULL, GL_STREAM_DRAW );
+        instancedCell->Bytes += grown - tileInstanceBytes;
+        gpuStats.bytes += grown - tileInstanceBytes;
+        tileInstanceBytes = grown;
+    }
+    glBufferSubData ( GL_ARRAY_BUFFER, 0, bytes, &tileInstances[0] );
+    profiler.count ( prof::COUNTER_UPLOADED, bytes );
+
+    // one draw for every tile, alone in its batch so its distance does not matter
+    enqueueDraw ( LAYER_OPAQUE, BATCH_BOARD, instancedProgramID, Matrices.InstancedMatrixID, instancedCell.get ( ), Matrices.VP,
+                  eye, count );
 }
 
-int checkBlock ( )
+/* Is every tile at rest : the board has risen, none has started sinking and none moved last tick */
+bool boardSettled ( )
 {
-    int i = ( Block.z_ordinate * 10 ) / 3;
-    int j = ( Block.x_ordinate * 10 ) / 3;
+    return ! stageStart && movedBegin == movedEnd && ( activeTiles.empty ( ) || activeTiles[ 0 ].y_ordinate >= -0.1f );
+}
 
-    if ( ( i < 0 || j < 0) || 
-        ( presentState == 0 && ( board[ i ][ j ] == 0 || board[ i ][ j ] == 7 || board[ i ][ j ] == 3 ) ) ||
-        ( presentState == 1 && ( board[ i ][ j ] == 0 || board[ i + 1 ][ j ] == 0 || board[ i + 1 ][ j ] == 7 || board[ i ][ j + 1 ] == 7) ) ||      
-        ( presentState == 2 && ( board[ i ][ j ] == 0 || board[ i ][ j + 1 ] == 0 || board[ i ][ j ] == 7 || board[ i ][ j + 1 ] == 7) ) ) 
-        return 1;
+/* Does the cell of level hold a tile that never moves : not empty, not the goal, not a bridge */
+bool staticTile ( const sim::Level &level, int i, int j )
+{
+    int t = level.tile ( i, j );
+    return t != sim::TILE_EMPTY && t != sim::TILE_GOAL && t != sim::TILE_BRIDGE;
+}
 
-    if ( presentState == 0 && board[ i ][ j ] == 2) 
-        return 2;
+/* Append face f of the cell mesh, as laid out by cellVertices, for the tile at row i, column j
+   of its chunk */
+void bakeFace ( vector < BakedVertex > &vertices, vector < GLuint > &indices, int i, int j, int palette, int f )
+{
+    // laid out once, safely whichever thread bakes first
+    static GLfloat cell [ 108 ];
+    static const bool laidOut = ( cellVertices ( 3, 3, -1, cell ), true );
+    ( void ) laidOut;
+
+    // a face is two triangles, v0 v1 v2 and v2 v4 v0
+    static const int corners [ 4 ] = { 0, 1, 2, 4 }, order [ 6 ] = { 0, 1, 2, 2, 3, 0 };
+    const GLfloat *color = &paletteColors[ palette ][ 18*f ];
+    GLuint base = vertices.size ( );
+    for ( int k = 0; k < 4; k++ ) {
+        const GLfloat *p = &cell[ 3 * ( 6*f + corners[ k ] ) ];
+        BakedVertex v;
+        v.position[ 0 ] = ( GLshort ) p[ 0 ] + 3 * j;
+        v.position[ 1 ] = ( GLshort ) p[ 1 ];
+        v.position[ 2 ] = ( GLshort ) p[ 2 ] + 3 * i;
+        v.position[ 3 ] = 1;
+        for ( int c = 0; c < 3; c++ )
+            v.color[ c ] = ( GLubyte ) ( color[ c ] * 255.0f + 0.5f );
+        v.color[ 3 ] = 255;
+        vertices.push_back ( v );
+    }
+    for ( int k = 0; k < 6; k++ )
+        indices.push_back ( base + order[ k ] );
+}
 
-    if ( ( presentState == 0 && board[ i ][ j ] >  3 ) ||
-        ( presentState == 1 && ( board[ i ][ j ] > 3 || board[ i + 1][ j ] > 3 ) ) ||
-        ( presentState == 2 && ( board[ i ][ j ] > 3 || board[ i ][ j + 1 ] > 3 ) ) ) {
+/* Indices as index_size byte integers; all zero, so every triangle is degenerate, unless drawn */
+vector < GLubyte > narrowIndices ( const vector < GLuint > &indices, int index_size, bool drawn )
+{
+    vector < GLubyte > data ( indices.size ( ) * index_size, 0 );
+    for ( size_t k = 0; drawn && k < indices.size ( ); k++ ) {
+        if ( index_size == 2 )
+            ( ( GLushort * ) &data[0] )[ k ] = ( GLushort ) indices[ k ];
+        else
+            ( ( GLuint * ) &data[0] )[ k ] = indices[ k ];
+    }
+    return data;
+}
 
-        int a = i, b = j;
-        if ( presentState == 0 ) {
-            a = i;
-            b = j;
+/* Bake chunk c of a level laid out as tiles into data, its bridges as bridges shows them : the
+   visible faces of its static tiles, then its bridges switch by switch, their runs added to runs */
+void bakeChunk ( const sim::Level &level, const vector < ActiveTile > &tiles, BoardChunk &chunk, size_t c,
+                 const sim::BridgeMask &bridgesDown, BakedChunkData &data, vector < BakedRun > &runs )
+{
+    vector < GLuint > indices;
+    vector < pair < int, size_t > > bridges;
+    int top = tiles[ chunk.begin ].row & ~sim::chunk_mask, left = tiles[ chunk.begin ].col & ~sim::chunk_mask;
+    chunk.bakedWorld = glm::translate ( glm::vec3 ( left * 0.3f - 1, 0, top * 0.3f - 1 ) ) * glm::scale ( glm::vec3 ( 0.1f ) );
+
+    // faces 1, 2, 4 and 5 are the sides towards row - 1, column - 1, row + 1 and column + 1, 3 is
+    // the top and 6 the bottom, kept as it shows where the near plane slices through the board
+    static const int side_rows [ 6 ] = { -1, 0, 0, 1, 0, 0 }, side_cols [ 6 ] = { 0, -1, 0, 0, 1, 0 };
+    for ( size_t t = chunk.begin; t < chunk.end; t++ ) {
+        const ActiveTile &tile = tiles[ t ];
+        if ( level.tile ( tile.row, tile.col ) == sim::TILE_BRIDGE ) {
+            bridges.push_back ( make_pair ( level.groupAt ( tile.row, tile.col ), t ) );
+            continue;
         }
-        else if ( presentState == 1 ) {
-            if ( board[ i ][ j ] > 3 ) {
-                a = i;
-                b = j;
-            }
-            else {
-                a = i + 1;
-                b = j ;
-            }
+        for ( int f = 0; f < 6; f++ )
+            if ( f == 2 || f == 5 || ! staticTile ( level, tile.row + side_rows[ f ], tile.col + side_cols[ f ] ) )
+                bakeFace ( data.vertices, indices, tile.row - top, tile.col - left, tile.palette, f );
+    }
+
+    // a bridge keeps every side, as the tiles next to it may be bridges that rise
+    std::stable_sort ( bridges.begin ( ), bridges.end ( ) );
+    size_t firstRun = runs.size ( );
+    vector < int > runFirst;
+    for ( size_t b = 0; b < bridges.size ( ); b++ ) {
+        int group = bridges[ b ].first;
+        if ( b == 0 || group != bridges[ b - 1 ].first ) {
+            BakedRun run = { c, group, 0, vector < GLubyte > ( ) };
+            runs.push_back ( run );
+            runFirst.push_back ( indices.size ( ) );
         }
-        else {
-            if ( board[ i ][ j ] > 3 ) {
-                a = i;
-                b = j;
-            }
-            else {
-                a = i ;
-                b = j + 1;
-            }
+        const ActiveTile &tile = tiles[ bridges[ b ].second ];
+        for ( int f = 0; f < 6; f++ )
+            bakeFace ( data.vertices, indices, tile.row - top, tile.col - left, tile.palette, f );
+    }
+    runFirst.push_back ( indices.size ( ) );
+
+    // Short indices unless the chunk has more vertices than they address; each run keeps its
+    // bytes, and those of bridges that are up start out zero
+    data.indexSize = data.vertices.size ( ) <= 0xffff ? 2 : 4;
+    data.indices = narrowIndices ( indices, data.indexSize, true );
+    for ( size_t r = firstRun; r < runs.size ( ); r++ ) {
+        BakedRun &run = runs[ r ];
+        GLubyte *begin = &data.indices[0] + runFirst[ r - firstRun ] * data.indexSize;
+        GLubyte *end = &data.indices[0] + runFirst[ r - firstRun + 1 ] * data.indexSize;
+        run.offset = begin - &data.indices[0];
+        run.indices.assign ( begin, end );
+        if ( ! bridgesDown.bit ( run.group ) )
+            std::fill ( begin, end, 0 );
+    }
+}
+
+// Level preparation : while a level is played the next one is decoded, laid out and baked on a
+// worker thread, so the tick that finishes a level only swaps it in.  The level swapped out
+// takes its place and is freed there when the worker next runs.  Start heights are drawn there
+// too : nothing else draws from gameRandom between two levels, so the worker starts from its
+// state when the level before was swapped in and hands back where it left it
+struct PreparedLevel {
+    int index;                          // in the pack, -1 before the first is prepared
+    bool loaded;                        // false past the end of the pack or on error
+    string name;
+    string error;
+    sim::Level level;
+    vector < ActiveTile > tiles;
+    vector < TileInstance > instances;  // as many as tiles, for the instanced board
+    vector < BoardChunk > chunks;
+    vector < BakedChunkData > baked;    // by chunk, empty with --no-bake
+    vector < BakedRun > runs;           // sorted by switch
+    vector < size_t > runStart;
+    sim::BridgeMask bridges;            // bridges down in the baked indices
+    uint64_t heightSeed;                // gameRandom before the start heights were drawn
+    sim::Random random;                 // and after
+    double seconds;
+
+    PreparedLevel ( ) : index ( -1 ), loaded ( false ), heightSeed ( 0 ), seconds ( 0 ) { }
+};
+
+PreparedLevel preparedLevel;
+std::thread preparer;
+bool reportLevels = true;               // print each level as it loads and once its board is uploaded
+
+/* Decode level index of the pack and lay out and bake its board into prepared, drawing start
+   heights from random; touches neither GL nor the level being played, so it runs on the worker */
+void prepareLevel ( int index, sim::Random random, PreparedLevel *prepared )
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now ( );
+    PreparedLevel &p = *prepared;
+    p.index = index;
+    p.heightSeed = random.seed;
+    p.tiles.clear ( );
+    p.chunks.clear ( );
+    p.baked.clear ( );
+    p.runs.clear ( );
+    p.runStart.clear ( );
+    p.loaded = levelPack.load ( index, p.level, p.name );
+    p.error = p.loaded ? string ( ) : levelPack.error;
+    if ( ! p.loaded )
+        return;
+
+    p.level.forEachTile ( [ & ] ( int i, int j, int v ) {
+        if ( v == sim::TILE_GOAL )
+            return;
+        glm::vec3 lo ( j * 0.3f - 1, -4.1f, i * 0.3f - 1 ), hi ( lo.x + 0.3f, 0.1f, lo.z + 0.3f );
+        const ActiveTile *last = p.tiles.empty ( ) ? NULL : &p.tiles.back ( );
+        if ( ! last || last->row >> sim::chunk_shift != i >> sim::chunk_shift || last->col >> sim::chunk_shift != j >> sim::chunk_shift ) {
+            BoardChunk chunk = { p.tiles.size ( ), p.tiles.size ( ), lo, hi, NULL, glm::mat4 ( 1.0f ) };
+            p.chunks.push_back ( std::move ( chunk ) );
+        }
+        BoardChunk &chunk = p.chunks.back ( );
+        chunk.end++;
+        chunk.lo = glm::min ( chunk.lo, lo );
+        chunk.hi = glm::max ( chunk.hi, hi );
+
+        float y = random.below ( 2 ) - 6.0f;
+        ActiveTile tile = { i, j, y, y, ( GLubyte ) tilePalette ( v, i, j ), glm::vec4 ( ), y, -1 };
+        p.tiles.push_back ( tile );
+    } );
+    p.instances.resize ( p.tiles.size ( ) );
+    p.random = random;
+
+    if ( bakeBoard ) {
+        p.bridges = sim::initialState ( p.level ).bridges;
+        p.baked.resize ( p.chunks.size ( ) );
+        for ( size_t c = 0; c < p.chunks.size ( ); c++ )
+            bakeChunk ( p.level, p.tiles, p.chunks[ c ], c, p.bridges, p.baked[ c ], p.runs );
+
+        std::stable_sort ( p.runs.begin ( ), p.runs.end ( ), [ ] ( const BakedRun &a, const BakedRun &b ) { return a.group < b.group; } );
+        p.runStart.assign ( p.level.bridges + 1, 0 );
+        for ( size_t r = 0, g = 0; g <= ( size_t ) p.level.bridges; g++ ) {
+            while ( r < p.runs.size ( ) && p.runs[ r ].group < ( int ) g )
+                r++;
+            p.runStart[ g ] = r;
         }
+    }
+    p.seconds = chrono::duration < double > ( chrono::steady_clock::now ( ) - start ).count ( );
+}
 
-        vector < int > V = bridgeMap[ board[ a ][ b ] ] ;
+/* Wait for the worker to finish preparing, if it is */
+void waitForPreparedLevel ( )
+{
+    if ( preparer.joinable ( ) )
+        preparer.join ( );
+}
 
-        if ( bridge[ board[ a ][ b ] ] == 0 ) {
-            for ( int k = 0; k < V.size ( ); k+=2 ) 
-                board[ V[ k ] ][ V[ k + 1 ] ] = 1;
-        
-            prevBridge[ board[ a ][ b ] ] = 0;
+/* Swap level index of the pack in, prepared ahead by the worker unless it is the first, then set
+   the worker on the level after it; issues no GL call, the baked board is uploaded over the
+   next frames.  False when the pack has no such level */
+bool loadLevel ( int index )
+{
+    static bool waitAtExit = false;
+    if ( ! waitAtExit ) {
+        atexit ( waitForPreparedLevel );
+        waitAtExit = true;
+    }
+
+    waitForPreparedLevel ( );
+    if ( preparedLevel.index != index || preparedLevel.heightSeed != gameRandom.seed )
+        prepareLevel ( index, gameRandom, &preparedLevel );
+    if ( ! preparedLevel.loaded ) {
+        if ( ! preparedLevel.error.empty ( ) )
+            fprintf ( stderr, "%s : %s\n", levelPath, preparedLevel.error.c_str ( ) );
+        return false;
+    }
+
+    // the level being left is swapped into preparedLevel, its meshes deleted on the next frame
+    retireBakedBoard ( );
+    PreparedLevel &p = preparedLevel;
+    levelName = p.name;
+    std::swap ( simLevel, p.level );
+    activeTiles.swap ( p.tiles );
+    tileInstances.swap ( p.instances );
+    boardChunks.swap ( p.chunks );
+    bakedUploads.swap ( p.baked );
+    bakedRuns.swap ( p.runs );
+    bakedRunStart.swap ( p.runStart );
+    bakedBridges = p.bridges;
+    bakedUpload = 0;
+    uploadedBytes = 0;
+    uploadFrames = 0;
+    for ( size_t r = 0; r < bakedRuns.size ( ); r++ )
+        if ( bakedRunUp.size ( ) < bakedRuns[ r ].indices.size ( ) )
+            bakedRunUp.resize ( bakedRuns[ r ].indices.size ( ), 0 );
+
+    gameRandom = p.random;
+
+    simState = nextState = sim::initialState ( simLevel );
+    Block.x_ordinate = simState.col * 0.3f;
+    Block.z_ordinate = simState.row * 0.3f;
+
+    boardCursor = movedBegin = movedEnd = 0;
+    boardSteps = 1 + activeTiles.size ( ) / 400;
+
+    if ( reportLevels )
+        fprintf ( stdout, "Level %d %s : %dx%d, %d tiles in %d chunks, prepared in %.3f s, %ld bytes of vertex data resident\n",
+                  level, levelName.c_str ( ), simLevel.rows, simLevel.cols, ( int ) activeTiles.size ( ), simLevel.chunkCount ( ),
+                  p.seconds, gpuStats.bytes );
+
+    preparer = std::thread ( prepareLevel, index + 1, gameRandom, &preparedLevel );
+    return true;
+}
+
+void levelup ( )
+{
+    level++;
+    // past the last level of the pack the game is over
+    if ( ! loadLevel ( level - 1 ) )
+        quit ( window );
+}
+
+/* Empty mesh for baked chunk data, its buffers allocated and filled later by streamBoardUpload */
+MeshHandle createBakedMesh ( const BakedChunkData &data )
+{
+    MeshHandle vao ( new VAO );
+    vao->ColorBuffer = 0;
+    vao->InstanceBuffer = 0;
+    vao->PrimitiveMode = GL_TRIANGLES;
+    vao->FillMode = GL_FILL;
+    vao->Format = FORMAT_PACKED;
+    vao->IndexType = data.indexSize == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    vao->NumVertices = data.vertices.size ( );
+    vao->NumIndices = data.indices.size ( ) / data.indexSize;
+
+    glGenVertexArrays ( 1, &( vao->VertexArrayID ) );
+    glGenBuffers ( 1, &( vao->VertexBuffer ) );
+    glGenBuffers ( 1, &( vao->IndexBuffer ) );
+    gpuStats.vertexArrays += 1;
+    gpuStats.buffers += 2;
+    profiler.count ( prof::COUNTER_OBJECTS, 3 );
+    vao->Bytes = data.vertices.size ( ) * sizeof ( BakedVertex ) + data.indices.size ( );
+    gpuStats.bytes += vao->Bytes;
+
+    bindVertexArray ( vao->VertexArrayID );
+
+    bindArrayBuffer ( vao->VertexBuffer );
+    glBufferData ( GL_ARRAY_BUFFER, data.vertices.size ( ) * sizeof ( BakedVertex ), NULL, GL_STATIC_DRAW );
+    glVertexAttribPointer ( 0, 3, GL_SHORT, GL_FALSE, sizeof ( BakedVertex ), ( void* ) offsetof ( BakedVertex, position ) );
+    glVertexAttribPointer ( 1, 3, GL_UNSIGNED_BYTE, GL_TRUE, sizeof ( BakedVertex ), ( void* ) offsetof ( BakedVertex, color ) );
+    glEnableVertexAttribArray ( 0 );
+    glEnableVertexAttribArray ( 1 );
+
+    // The element buffer binding is recorded in the VAO
+    glBindBuffer ( GL_ELEMENT_ARRAY_BUFFER, vao->IndexBuffer );
+    glBufferData ( GL_ELEMENT_ARRAY_BUFFER, data.indices.size ( ), NULL, GL_STATIC_DRAW );
+    return vao;
+}
+
+/* Once a frame : delete the meshes of the level left, then move up to upload_budget bytes of the
+   baked board into its chunk meshes, written to the staging buffer and copied from there on the
+   GPU.  Chunks are freed on the CPU as they complete; the board is drawn baked once all are in */
+void streamBoardUpload ( )
+{
+    retiredMeshes.clear ( );
+    if ( boardBaked || ! bakeBoard )
+        return;
+
+    if ( ! stagingBuffer.get ( ) ) {
+        GLuint buffer;
+        glGenBuffers ( 1, &buffer );
+        stagingBuffer.reset ( buffer, upload_budget );
+        gpuStats.buffers += 1;
+        gpuStats.bytes += upload_budget;
+        profiler.count ( prof::COUNTER_OBJECTS );
+    }
+    // orphaned every frame, so writing it never waits for last frame's copies
+    glBindBuffer ( GL_COPY_READ_BUFFER, stagingBuffer.get ( ) );
+    glBufferData ( GL_COPY_READ_BUFFER, upload_budget, NULL, GL_STREAM_DRAW );
+
+    GLsizeiptr staged = 0;
+    while ( staged < upload_budget && bakedUpload < bakedUploads.size ( ) ) {
+        BakedChunkData &data = bakedUploads[ bakedUpload ];
+        BoardChunk &chunk = boardChunks[ bakedUpload ];
+        if ( ! chunk.baked )
+            chunk.baked = createBakedMesh ( data );
+
+        GLsizeiptr vertexBytes = data.vertices.size ( ) * sizeof ( BakedVertex ), totalBytes = vertexBytes + data.indices.size ( );
+        if ( uploadedBytes < totalBytes ) {
+            bool vertices = uploadedBytes < vertexBytes;
+            GLintptr offset = vertices ? uploadedBytes : uploadedBytes - vertexBytes;
+            GLsizeiptr size = min ( ( vertices ? vertexBytes : totalBytes ) - uploadedBytes, upload_budget - staged );
+            const GLubyte *source = vertices ? ( const GLubyte * ) &data.vertices[0] : &data.indices[0];
+
+            glBufferSubData ( GL_COPY_READ_BUFFER, staged, size, source + offset );
+            glBindBuffer ( GL_COPY_WRITE_BUFFER, vertices ? chunk.baked->VertexBuffer : chunk.baked->IndexBuffer );
+            glCopyBufferSubData ( GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, staged, offset, size );
+            staged += size;
+            uploadedBytes += size;
         }
-        else {
-            for ( int k = 0; k < V.size ( ); k+=2 ) 
-                board[ V[ k ] ][ V[ k + 1 ] ] = 7;
-            
-            prevBridge[ board[ a ][ b ] ] = 1;
+        if ( uploadedBytes == totalBytes ) {
+            vector < BakedVertex > ( ).swap ( data.vertices );
+            vector < GLubyte > ( ).swap ( data.indices );
+            bakedUpload++;
+            uploadedBytes = 0;
         }
-        prev_Bridge = board[ a ][ b ];
-        return 0;
     }
+    profiler.count ( prof::COUNTER_UPLOADED, staged );
+    uploadFrames++;
+
+    if ( bakedUpload == bakedUploads.size ( ) ) {
+        boardBaked = true;
+        bakedUploads.clear ( );
+        if ( reportLevels )
+            fprintf ( stdout, "Baked %d chunks, uploaded over %d frames\n", ( int ) boardChunks.size ( ), uploadFrames );
+    }
+}
 
-    if ( prevBridge[ prev_Bridge] == 0 ) {
-        bridge[ prev_Bridge ] = 1;
+/* Rewrite the runs of the switches whose bridges rose or fell since the last frame, found from the
+   bits that changed; each costs an upload of 72 or 144 bytes per bridge and no allocation */
+void rebakeBridges ( )
+{
+    for ( int w = 0; w < sim::bridge_words; w++ ) {
+        for ( uint64_t changed = simState.bridges.words[ w ] ^ bakedBridges.words[ w ]; changed; changed &= changed - 1 ) {
+            int g = w * 64 + __builtin_ctzll ( changed );
+            if ( g >= simLevel.bridges )
+                continue;
+            bool down = simState.bridges.bit ( g );
+            for ( size_t r = bakedRunStart[ g ]; r < bakedRunStart[ g + 1 ]; r++ ) {
+                const BakedRun &run = bakedRuns[ r ];
+                const VAO *vao = boardChunks[ run.chunk ].baked.get ( );
+
+                // the element buffer binding belongs to the vertex array
+                bindVertexArray ( vao->VertexArrayID );
+                glBindBuffer ( GL_ELEMENT_ARRAY_BUFFER, vao->IndexBuffer );
+                glBufferSubData ( GL_ELEMENT_ARRAY_BUFFER, run.offset, run.indices.size ( ), down ? &run.indices[0] : &bakedRunUp[0] );
+                profiler.count ( prof::COUNTER_UPLOADED, run.indices.size ( ) );
+            }
+        }
     }
-    else {
-        bridge[ prev_Bridge ] = 0;
+    bakedBridges = simState.bridges;
+}
+
+/* Draw the settled board from its baked chunks, one draw call per chunk in view */
+void drawBoardBaked ( )
+{
+    rebakeBridges ( );
+
+    for ( size_t c = 0; c < boardChunks.size ( ); c++ ) {
+        const BoardChunk &chunk = boardChunks[ c ];
+        if ( ! chunk.baked->NumIndices || ! chunkOnScreen ( chunk ) )
+            continue;
+        glm::mat4 MVP = Matrices.VP * chunk.bakedWorld;
+        profiler.count ( prof::COUNTER_MATRICES );
+        enqueueDraw ( LAYER_OPAQUE, BATCH_BOARD, programID, Matrices.MatrixID, chunk.baked.get ( ), MVP, ( chunk.lo + chunk.hi ) * 0.5f );
+    }
+}
+
+/* Queue the tiles of the level that any of the current views can see */
+void drawBoard ( float alpha )
+{
+    if ( boardBaked && boardSettled ( ) ) {
+        drawBoardBaked ( );
+        return;
+    }
+
+    if ( instanced ) {
+        drawBoardInstanced ( alpha );
+        return;
+    }
+
+    for ( size_t c = 0; c < boardChunks.size ( ); c++ ) {
+        if ( ! chunkOnScreen ( boardChunks[ c ] ) )
+            continue;
+        for ( size_t t = boardChunks[ c ].begin; t < boardChunks[ c ].end; t++ ) {
+            ActiveTile &tile = activeTiles[ t ];
+            float y = tile.interpolatedY ( alpha );
+            if ( ! tileOnScreen ( tile, y ) )
+                continue;
+            enqueueDraw ( LAYER_OPAQUE, ( DrawBatch ) ( BATCH_TILE + tile.palette ), programID, Matrices.MatrixID,
+                          materialMeshes[ tile.palette ].get ( ), tile.mvp ( y ), tile.position ( y ) );
+        }
+    }
+}
+
+void fallBlocksBoards ( )
+{
+    if ( Block.y_ordinate > -6.0f ) {
+            Block.y_ordinate -= 0.1f;
+            return;
+        }
+    // tiles sink one after the other, and every tile before the cursor is already down
+    movedBegin = boardCursor;
+    for ( int s = 0; s < boardSteps; s++ ) {
+        while ( boardCursor < activeTiles.size ( ) && activeTiles[ boardCursor ].y_ordinate < -5.0f )
+            boardCursor++;
+        if ( boardCursor == activeTiles.size ( ) ) {
+            movedEnd = boardCursor;
+            boardCursor = 0;
+            stageStart = 1;
+            return;
+        }
+        activeTiles[ boardCursor ].y_ordinate -= 1.0f;
+    }
+    movedEnd = boardCursor + 1;
+}
+
+void buildBlocksBoards ( )
+{
+    movedBegin = boardCursor;
+    for ( int s = 0; s < boardSteps; s++ ) {
+        while ( boardCursor < activeTiles.size ( ) && activeTiles[ boardCursor ].y_ordinate >= -0.1f )
+            boardCursor++;
+        if ( boardCursor == activeTiles.size ( ) ) {
+            movedEnd = boardCursor;
+            boardCursor = 0;
+            stageStart = 0;
+            return;
+        }
+        activeTiles[ boardCursor ].y_ordinate += 1.0f;
+    }
+    movedEnd = boardCursor + 1;
+}
+
+/* 0 : resting safely, 1 : falling, 2 : standing on the goal */
+int checkBlock ( )
+{
+    switch ( sim::evaluate ( simLevel, simState ) ) {
+        case sim::OUTCOME_FALL:
+            return 1;
+        case sim::OUTCOME_GOAL:
+            return 2;
+        default:
+            return 0;
     }
-    return 0;
 }
 
-void Viewer ( )
+void Viewer ( int view )
 {
-    switch ( views ) {
+    switch ( view ) {
             case 0:
                 //Block
                 perspective = 1;
@@ -1281,94 +2741,65 @@ void Viewer ( )
 
 void reset ( )
 {    
-    for ( map < int, vector< int > >::iterator it = bridgeMap.begin ( ); it != bridgeMap.end ( ); it++ ) {
-        vector < int > V = bridgeMap[it->first];
-        for ( int i = 0; i < board_size; i++ ) {
-            for ( int j = 0; j < board_size; j++ ) {
-                if ( board[ i ][ j ] == it->first ) {  
-                    for ( int k = 0; k < 4; k += 2 )
-                        board[ V [ k ] ][ V [ k + 1 ] ] = 7;
-                    bridge[ it->first ] = 0;
-                    prevBridge[ it->first ] = 1;
-                }
-            }
-        }
-    }
+    simState = nextState = sim::initialState ( simLevel );
     theta = 0.0f;
     direction = 5;
     presentState = futureState = 0;
     Block.y_ordinate = 6.0f;
-    Block.x_ordinate = 0.0f;
-    Block.z_ordinate = 0.0f;
+    Block.x_ordinate = simState.col * 0.3f;
+    Block.z_ordinate = simState.row * 0.3f;
     Block.Irotator( );
     Block.Itranslator( );
     Block.rotator ( );
     Block.translator ( Block.x_ordinate - 1, Block.y_ordinate, Block.z_ordinate - 1);
+    Block.snapshot ( );
+    previous_theta = 0.0f;
 }
 
-// Render the scene with openGL 
-// Edit this function according to your assignment 
-void draw ( GLFWwindow* window, float x, float y, float w, float h )
+/* Start a profiled frame, reusing the query slot of gpu_query_frames frames ago */
+void beginProfiledFrame ( )
 {
-    int fbwidth, fbheight;
-    glfwGetFramebufferSize ( window, &fbwidth, &fbheight );
-    glViewport ( (int)(x*fbwidth), (int)(y*fbheight), (int)(w*fbwidth), (int)(h*fbheight) );
-    double currentMousex;
-    double currentMousey;
-    if ( left_button == 1 ) {
-        glfwGetCursorPos( window, &currentMousex, &currentMousey);
-        camera_rotation_angle = currentMousex - oldMousex;
-    }
-    else {
-        camera_rotation_angle = 70.0f;
-    }
-
-    // use the loaded shader program
-    // Don't change unless you know what you are doing
-    glUseProgram ( programID );
-
-    Viewer ( );
-
-    // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-    glm::vec3 up ( 0, 1, 0 );
-    Matrices.view = glm::lookAt ( eye, target, up ); // Fixed camera for 2D (ortho) in XY plane
+    profiler.beginFrame ( );
+    if ( profiler.enabled )
+        collectGpuPhases ( gpuFrame % gpu_query_frames, false );
+}
 
-    // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-    //  Don't change unless you are sure!!
-    glm::mat4 VP =  ( perspective ? Matrices.projectionP : Matrices.projectionO ) * Matrices.view;
+void endProfiledFrame ( )
+{
+    profiler.endFrame ( );
+    gpuFrame++;
+}
 
-    renderscore ( 0, 4, 0, level );
-    renderscore ( 3, 2, 0, ( int ) glfwGetTime ( ) );
-    renderscore ( -3, 1, 0, moves );
+/* Advance the game by one fixed tick : rise or sink the board, drop and roll the block,
+   then fall off or finish the level */
+void update ( )
+{
+    // replayed inputs land before the tick they were recorded before
+    replay::Input input;
+    while ( player.next ( gameTick, input ) )
+        applyInput ( input );
 
-    glm::mat4 MVP;	
-    
-    Matrices.model = glm::mat4 (1.0f);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv (Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-    draw3DObject (background);  
+    Block.snapshot ( );
+    for ( size_t t = movedBegin; t < movedEnd; t++ )
+        activeTiles[ t ].y_previous = activeTiles[ t ].y_ordinate;
+    movedBegin = movedEnd = 0;
+    previous_theta = theta;
 
     if ( stageStart ) {
         buildBlocksBoards ( );
     }
 
-    drawBoard ( );
-
     if ( ! stageStart && Block.y_ordinate > 0.1 ) {
          Block.y_ordinate -= 0.1f; 
     }
 
-    blockRotator ( );
-
-    Block.render ( );
+    profiler.begin ( prof::PHASE_ROLL );
+    rollBlock ( );
+    profiler.end ( prof::PHASE_ROLL );
 
-    
+    profiler.begin ( prof::PHASE_CHECK );
     switch ( checkBlock ( ) ) {
         
-        case 0:
-            Block.render ( );
-            break;
-        
         case 1:
             if ( ! stageStart )
                 fallBlocksBoards ( );        
@@ -1388,6 +2819,181 @@ void draw ( GLFWwindow* window, float x, float y, float w, float h )
         default :
             break;   
     }
+    profiler.end ( prof::PHASE_CHECK );
+    gameTick++;
+}
+
+/* Mouse drag turns the helicopter and tower cameras */
+void cameraInput ( GLFWwindow* window )
+{
+    double currentMousex;
+    double currentMousey;
+    if ( left_button == 1 ) {
+        glfwGetCursorPos( window, &currentMousex, &currentMousey);
+        camera_rotation_angle = currentMousex - oldMousex;
+    }
+    else {
+        camera_rotation_angle = 70.0f;
+    }
+}
+
+/* ViewProject matrix of camera mode view for a viewport of the given aspect ratio */
+glm::mat4 viewProjection ( int view, float aspect )
+{
+    profiler.begin ( prof::PHASE_VIEWER );
+    Viewer ( view );
+    profiler.end ( prof::PHASE_VIEWER );
+
+    // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
+    glm::vec3 up ( 0, 1, 0 );
+    Matrices.view = glm::lookAt ( eye, target, up ); // Fixed camera for 2D (ortho) in XY plane
+
+    //  Don't change unless you are sure!!
+    if ( perspective )
+        return glm::perspective ( Matrices.fov, aspect, 0.1f, 500.0f ) * Matrices.view;
+    return Matrices.projectionO * Matrices.view;
+}
+
+/* Draw everything with VP from now on; objects only rebuild their MVP when it changed */
+void setViewProjection ( const glm::mat4 &VP )
+{
+    if ( VP != Matrices.VP ) {
+        Matrices.VP = VP;
+        Matrices.VPVersion++;
+    }
+}
+
+/* HUD, background, board and block, alpha of the way from the last tick to the next,
+   with the current programs, VP and frustums : queued, then drawn in the queue's order */
+void drawScene ( float alpha )
+{
+    profiler.begin ( prof::PHASE_HUD );
+    renderscore ( levelHud, level );
+    renderscore ( timeHud, ( int ) clockSeconds ( ) );
+    renderscore ( movesHud, moves );
+    profiler.end ( prof::PHASE_HUD );
+
+    // the background is in world space
+    enqueueDraw ( LAYER_BACKGROUND, BATCH_BACKGROUND, programID, Matrices.MatrixID, background.get ( ), Matrices.VP, glm::vec3 ( 0 ) );
+
+    profiler.begin ( prof::PHASE_BOARD );
+    drawBoard ( alpha );
+    profiler.end ( prof::PHASE_BOARD );
+
+    profiler.begin ( prof::PHASE_BLOCK );
+    placeBlock ( previous_theta + ( theta - previous_theta ) * alpha, Block.interpolatedY ( alpha ) );
+    enqueueDraw ( LAYER_OPAQUE, BATCH_BLOCK, programID, Matrices.MatrixID, Block.object, Block.mvp ( ), Block.position ( ) );
+    profiler.end ( prof::PHASE_BLOCK );
+
+    profiler.begin ( prof::PHASE_SUBMIT );
+    submitRenderQueue ( );
+    profiler.end ( prof::PHASE_SUBMIT );
+}
+
+// Render the scene with openGL, alpha of the way from the last tick to the next, as seen
+// by camera mode view in the rectangle x, y, w, h of the window
+// Edit this function according to your assignment 
+void draw ( GLFWwindow* window, float x, float y, float w, float h, float alpha, int view )
+{
+    int fbwidth = headless.width, fbheight = headless.height;
+    if ( window )
+        glfwGetFramebufferSize ( window, &fbwidth, &fbheight );
+    glViewport ( (int)(x*fbwidth), (int)(y*fbheight), (int)(w*fbwidth), (int)(h*fbheight) );
+    cameraInput ( window );
+
+    // use the loaded shader program
+    // Don't change unless you know what you are doing
+    useProgram ( programID );
+
+    glm::mat4 VP = viewProjection ( view, ( w*fbwidth ) / ( h*fbheight ) );
+    setViewProjection ( VP );
+    extractFrustum ( 0, VP );
+    frustumCount = 1;
+
+    drawScene ( alpha );
+}
+
+/* Rectangle of split screen view v, as fractions of the window */
+void splitRect ( int v, float &x, float &y, float &w, float &h )
+{
+    bool top = v < 3;
+    w = top ? 1.0f / 3 : 0.5f;
+    h = 0.5f;
+    x = ( top ? v : v - 3 ) * w;
+    y = top ? 0.5f : 0.0f;
+}
+
+/* Every camera mode at once.  With viewport arrays the scene is traversed and uploaded once :
+   the vertex shaders leave it in world space and a geometry shader copies each triangle into
+   every view.  Without them each view is drawn in turn */
+void drawSplit ( GLFWwindow* window, float alpha )
+{
+    float x, y, w, h;
+    if ( splitFlatShader < 0 ) {
+        for ( int v = 0; v < split_views; v++ ) {
+            splitRect ( v, x, y, w, h );
+            draw ( window, x, y, w, h, alpha, v );
+        }
+        return;
+    }
+
+    int fbwidth = headless.width, fbheight = headless.height;
+    if ( window )
+        glfwGetFramebufferSize ( window, &fbwidth, &fbheight );
+    cameraInput ( window );
+
+    GLfloat viewports [ split_views ][ 4 ];
+    glm::mat4 viewProjections [ split_views ];
+    for ( int v = 0; v < split_views; v++ ) {
+        splitRect ( v, x, y, w, h );
+        viewports[ v ][ 0 ] = x*fbwidth;
+        viewports[ v ][ 1 ] = y*fbheight;
+        viewports[ v ][ 2 ] = w*fbwidth;
+        viewports[ v ][ 3 ] = h*fbheight;
+        viewProjections[ v ] = viewProjection ( v, ( w*fbwidth ) / ( h*fbheight ) );
+        extractFrustum ( v, viewProjections[ v ] );
+    }
+    frustumCount = split_views;
+    glViewportArrayv ( 0, split_views, &viewports[0][0] );
+
+    useScenePrograms ( true );
+    for ( int k = 0; k < 2; k++ ) {
+        const ScenePrograms &programs = scenePrograms[ 1 ];
+        useProgram ( k ? programs.instanced : programs.flat );
+        glUniformMatrix4fv ( k ? programs.instancedViews : programs.flatViews, split_views, GL_FALSE, &viewProjections[0][0][0] );
+        glUniform1i ( k ? programs.instancedViewCount : programs.flatViewCount, split_views );
+        profiler.count ( prof::COUNTER_UNIFORMS, 2 );
+    }
+    useProgram ( programID );
+    setViewProjection ( glm::mat4 ( 1.0f ) );
+
+    drawScene ( alpha );
+    useScenePrograms ( false );
+}
+
+/* Pick up the current programs, at startup and after a reload : uniform handles and the palette */
+void bindShaderPrograms ( )
+{
+    // a reload may have deleted the program in use and handed its name to another
+    invalidateGLState ( );
+    int shaders [ 2 ][ 2 ] = { { flatShader, instancedShader }, { splitFlatShader, splitInstancedShader } };
+    for ( int split = 0; split < 2; split++ ) {
+        if ( shaders[ split ][ 0 ] < 0 )
+            continue;
+        ScenePrograms &programs = scenePrograms[ split ];
+        programs.flat = shaderPrograms[ shaders[ split ][ 0 ] ].id.get ( );
+        // Get a handle for our "MVP" uniform
+        programs.flatMVP = glGetUniformLocation ( programs.flat, "MVP" );
+        programs.flatViews = glGetUniformLocation ( programs.flat, "viewProjections" );
+        programs.flatViewCount = glGetUniformLocation ( programs.flat, "viewCount" );
+
+        programs.instanced = shaderPrograms[ shaders[ split ][ 1 ] ].id.get ( );
+        programs.instancedVP = glGetUniformLocation ( programs.instanced, "VP" );
+        programs.instancedViews = glGetUniformLocation ( programs.instanced, "viewProjections" );
+        programs.instancedViewCount = glGetUniformLocation ( programs.instanced, "viewCount" );
+        loadPalette ( programs.instanced );
+    }
+    useScenePrograms ( false );
 }
 
 // Initialise glfw window, I/O callbacks and the renderer to use 
@@ -1414,7 +3020,7 @@ GLFWwindow* initGLFW ( int width, int height )
    }
 
    glfwMakeContextCurrent ( window );
-   glfwSwapInterval ( 1 );
+   glfwSwapInterval ( swapInterval );
    glfwSetFramebufferSizeCallback ( window, reshapeWindow );
    glfwSetWindowSizeCallback ( window, reshapeWindow );
    glfwSetWindowCloseCallback (window, quit );
@@ -1431,78 +3037,439 @@ GLFWwindow* initGLFW ( int width, int height )
     return window;
 }
 
-// Initialize the OpenGL rendering properties 
-// Add all the models to be created here 
-void initGL ( GLFWwindow* window, int width, int height )
+/* Is name a whole word of an EGL extension string */
+bool hasExtension ( const char *extensions, const char *name )
 {
-    // Objects should be created before any other gl function and shaders 
-    // Create the models
+    size_t length = strlen ( name );
+    for ( const char *p = extensions; p && ( p = strstr ( p, name ) ); p += length )
+        if ( ( p == extensions || p[ -1 ] == ' ' ) && ( p[ length ] == ' ' || p[ length ] == '\0' ) )
+            return true;
+    return false;
+}
 
-    Background ( );
-    drawAxes ( );
+// Create an offscreen OpenGL 3.3 core context : surfaceless Mesa platform when available
+// ( llvmpipe needs no display server ), else the default display with a pbuffer
+void initHeadless ( int width, int height )
+{
+    headless.enabled = true;
+    headless.width = width;
+    headless.height = height;
+
+    const char *client = eglQueryString ( EGL_NO_DISPLAY, EGL_EXTENSIONS );
+    headless.display = EGL_NO_DISPLAY;
+    if ( hasExtension ( client, "EGL_MESA_platform_surfaceless" ) ) {
+        PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+            ( PFNEGLGETPLATFORMDISPLAYEXTPROC ) eglGetProcAddress ( "eglGetPlatformDisplayEXT" );
+        if ( getPlatformDisplay )
+            headless.display = getPlatformDisplay ( EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL );
+    }
+    if ( headless.display == EGL_NO_DISPLAY )
+        headless.display = eglGetDisplay ( EGL_DEFAULT_DISPLAY );
+
+    EGLint major, minor;
+    if ( headless.display == EGL_NO_DISPLAY || ! eglInitialize ( headless.display, &major, &minor ) || ! eglBindAPI ( EGL_OPENGL_API ) ) {
+        fprintf ( stderr, "Headless : no EGL display with desktop OpenGL\n" );
+        exit ( EXIT_FAILURE );
+    }
+
+    bool surfaceless = hasExtension ( eglQueryString ( headless.display, EGL_EXTENSIONS ), "EGL_KHR_surfaceless_context" );
+    EGLint configAttributes [ ] = {
+        EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint configs = 0;
+    if ( ! eglChooseConfig ( headless.display, configAttributes, &config, 1, &configs ) || configs == 0 ) {
+        fprintf ( stderr, "Headless : no EGL config for desktop OpenGL\n" );
+        exit ( EXIT_FAILURE );
+    }
+
+    EGLint contextAttributes [ ] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    headless.context = eglCreateContext ( headless.display, config, EGL_NO_CONTEXT, contextAttributes );
+    if ( headless.context == EGL_NO_CONTEXT ) {
+        fprintf ( stderr, "Headless : cannot create an OpenGL 3.3 core context\n" );
+        exit ( EXIT_FAILURE );
+    }
+
+    headless.surface = EGL_NO_SURFACE;
+    if ( ! surfaceless ) {
+        EGLint surfaceAttributes [ ] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+        headless.surface = eglCreatePbufferSurface ( headless.display, config, surfaceAttributes );
+    }
+    if ( ! eglMakeCurrent ( headless.display, headless.surface, headless.surface, headless.context ) ) {
+        fprintf ( stderr, "Headless : cannot make the context current\n" );
+        exit ( EXIT_FAILURE );
+    }
+}
+
+/* Colour and depth renderbuffers the frames are drawn into; needs the GL entry points loaded */
+void createHeadlessFramebuffer ( )
+{
+    glGenRenderbuffers ( 1, &headless.colorBuffer );
+    glBindRenderbuffer ( GL_RENDERBUFFER, headless.colorBuffer );
+    glRenderbufferStorage ( GL_RENDERBUFFER, GL_RGBA8, headless.width, headless.height );
+
+    glGenRenderbuffers ( 1, &headless.depthBuffer );
+    glBindRenderbuffer ( GL_RENDERBUFFER, headless.depthBuffer );
+    glRenderbufferStorage ( GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, headless.width, headless.height );
+
+    glGenFramebuffers ( 1, &headless.framebuffer );
+    glBindFramebuffer ( GL_FRAMEBUFFER, headless.framebuffer );
+    glFramebufferRenderbuffer ( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, headless.colorBuffer );
+    glFramebufferRenderbuffer ( GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, headless.depthBuffer );
+
+    if ( glCheckFramebufferStatus ( GL_FRAMEBUFFER ) != GL_FRAMEBUFFER_COMPLETE ) {
+        fprintf ( stderr, "Headless : incomplete framebuffer\n" );
+        exit ( EXIT_FAILURE );
+    }
+}
+
+/* Write the framebuffer as a binary PPM, top row first */
+void dumpFrame ( const char *path )
+{
+    int w = headless.width, h = headless.height;
+    vector < unsigned char > pixels ( w * h * 3 );
+    glPixelStorei ( GL_PACK_ALIGNMENT, 1 );
+    glReadPixels ( 0, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0] );
+
+    FILE *file = fopen ( path, "wb" );
+    if ( ! file ) {
+        fprintf ( stderr, "cannot write %s\n", path );
+        return;
+    }
+    fprintf ( file, "P6\n%d %d\n255\n", w, h );
+    for ( int row = h - 1; row >= 0; row-- )
+        fwrite ( &pixels[ row * w * 3 ], 1, w * 3, file );
+    fclose ( file );
+}
+
+/* Headless stand in for the buffer swap : wait for the frame, dump it if asked */
+void finishHeadlessFrame ( )
+{
+    glFinish ( );
+    if ( ! headless.dumpPrefix.empty ( ) && headless.frame % headless.dumpEvery == 0 ) {
+        char path [ 512 ];
+        snprintf ( path, sizeof ( path ), "%s%05ld.ppm", headless.dumpPrefix.c_str ( ), headless.frame );
+        dumpFrame ( path );
+    }
+    headless.frame++;
+}
+
+/* The block and the first level, from the session seed; needs no GL context, the
+   meshes are attached by initGL */
+void initGame ( )
+{
+    gameRandom = sim::Random ( gameSeed );
 
-    // BLOCK
     x_ordinate = 0.0f;
-    y_ordinate = rand ( ) % 2 + 6.0f;
+    y_ordinate = gameRandom.below ( 2 ) + 6.0f;
     z_ordinate = 0.0f;
     GraphicalObject temp = GraphicalObject ( x_ordinate, y_ordinate, z_ordinate, 0.6f, 0.3f );
-    temp.object  = createCell ( 0.3f, 0.3f, 0.6f,  Blue);
     Block = temp;
     Block.translator ( Block.x_ordinate - 1, Block.y_ordinate, Block.z_ordinate - 1 );
 
-    //BOARD
-    for ( int i = 0; i < board_size; i++ )
-        for ( int j = 0; j < board_size; j++ )
-            board[ i ][ j ] = stage1[ i ][ j ];
-
-    for ( int i = 0; i < board_size; i++ ) {
-        VAO *cell;
-        GraphicalObject temp;
-         x_ordinate = 0.0f;
-        for ( int j = 0; j < board_size; j++ ) {
-            y_ordinate = rand ( ) % 2 - 6.0f;
-            if ( board[ i ][ j ] == 1) {
-                if ( ( i + j ) % 2 == 0 ) {
-                    cell = createCell ( 0.3f, 0.3f, -0.1f, Grey );
-                    temp = GraphicalObject ( x_ordinate, y_ordinate, z_ordinate, 0.1f, 0.3f, 'r' );
-                }
-                else {
-                    cell = createCell ( 0.3f, 0.3f, -0.1f, White );
-                    temp = GraphicalObject ( x_ordinate, y_ordinate, z_ordinate, 0.1f, 0.3f,  'g' );
-                }
-            }
-            else if ( board[ i ][ j ] == 3 ) {
-                if ( ( i + j ) % 2 == 0 ) {
-                    cell = createCell ( 0.3f, 0.3f, -0.1f,  Orange );
-                    temp = GraphicalObject ( x_ordinate, y_ordinate, z_ordinate, 0.1f, 0.3f,  'b' );
-                }
-                else {
-                    cell = createCell ( 0.3f, 0.3f, -0.1f,  Dorange );
-                    temp = GraphicalObject ( x_ordinate, y_ordinate, z_ordinate, 0.1f, 0.3f,  'b' );   
-                }
-            }
-            else {
-                cell = createCell ( 0.3f, 0.3f, -0.1f,  Green );
-                temp = GraphicalObject ( x_ordinate, y_ordinate, z_ordinate, 0.1f, 0.3f,  'b' );   
-            }
-            temp.object = cell;
-            Board[ i ][ j ] = temp;
-            x_ordinate += 0.3f;
-        }
-        z_ordinate += 0.3f;
+    if ( ! loadLevel ( 0 ) ) {
+        glfwTerminate ( );
+        exit ( EXIT_FAILURE );
     }
-    bridgeConstruct ( );
+}
+
+// Initialize the OpenGL rendering properties 
+// Add all the models to be created here 
+void initGL ( GLFWwindow* window, int width, int height )
+{
+    // Objects should be created before any other gl function and shaders 
+    // Create the models
+
+    if ( headless.enabled )
+        createHeadlessFramebuffer ( );
+
+    Background ( );
+
+    // HUD
+    levelHud = createHudNumber ( 0, 4, 0 );
+    timeHud = createHudNumber ( 3, 2, 0 );
+    movesHud = createHudNumber ( -3, 1, 0 );
+
+    // BLOCK and BOARD
+    createMaterialMeshes ( );
+    initGame ( );
+    blockMesh = createCell ( 0.3f, 0.3f, 0.6f, &Blue[0] );
+    Block.object = blockMesh.get ( );
 
     // Create and compile our GLSL program from the shaders
-    programID = LoadShaders ( "Sample_GL.vert", "Sample_GL.frag" );
-    // Get a handle for our "MVP" uniform
-    Matrices.MatrixID = glGetUniformLocation ( programID, "MVP" );
+    flatShader = addShaderProgram ( "Sample_GL.vert", "Sample_GL.frag" );
+    // Instanced board : one shared cell, colours looked up from the palette
+    instancedShader = addShaderProgram ( "Sample_GL_Instanced.vert", "Sample_GL.frag" );
+    // Split screen : both again, each triangle copied to every view by a geometry shader
+    if ( GLEW_VERSION_4_1 || GLEW_ARB_viewport_array ) {
+        splitFlatShader = addShaderProgram ( "Sample_GL.vert", "Sample_GL_Split.frag", "Sample_GL_Split.geom" );
+        splitInstancedShader = addShaderProgram ( "Sample_GL_Instanced.vert", "Sample_GL_Split.frag", "Sample_GL_Split.geom" );
+    }
+    buildShaderPrograms ( );
+    bindShaderPrograms ( );
+    instancedCell = createInstancedCell ( 0.3f, 0.3f, -0.1f );
     reshapeWindow ( window, width, height );
     // Background color of the scene
     glClearColor ( 0.3f, 0.3f, 0.3f, 0.0f ); // R, G, B, A
     glClearDepth ( 1.0f );
     glEnable ( GL_DEPTH_TEST );
     glDepthFunc ( GL_LEQUAL );
+
+    for ( int slot = 0; slot < gpu_query_frames; slot++ )
+        glGenQueries ( gpu_spans_per_frame, gpuSpans[ slot ].queries );
+    glGenQueries ( gpu_query_frames, fragmentQueries );
+}
+
+// Bridge masks each level's rest masks are checked with : every bridge up, every one down,
+// then random ones
+const int rest_mask_checks = 10;
+
+/* Play random moves on every level of the pack without a window and report the simulation
+   throughput, after checking the word parallel rest masks against the scalar rules; returns
+   the exit status */
+int simBenchmark ( long steps )
+{
+    sim::Level level;
+    string name;
+    long checked = 0, mismatches = 0;
+    for ( int k = 0; levelPack.load ( k, level, name ); k++ ) {
+        sim::Random random ( k + 1 );
+
+        sim::BridgeMask bridges;
+        for ( int m = 0; m < rest_mask_checks; m++ ) {
+            bridges.clear ( );
+            for ( int g = 0; g < level.bridges; g++ )
+                bridges.press ( g, m == 1 || ( m > 1 && random.below ( 2 ) ), 0 );
+            mismatches += sim::checkRestMasks ( level, bridges, checked );
+        }
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now ( );
+        long goals = sim::randomWalk ( level, steps, random );
+        double seconds = chrono::duration < double > ( chrono::steady_clock::now ( ) - start ).count ( );
+
+        fprintf ( stdout, "level %d %s : %ld moves in %.3f s, %.2f M moves/s, %ld goals\n",
+                  k + 1, name.c_str ( ), steps, seconds, steps / seconds / 1e6, goals );
+    }
+    fprintf ( stdout, "Rest masks : %ld positions checked against the scalar rules, %ld differ\n", checked, mismatches );
+    return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Solve every level of the pack and print its optimal move sequence and the solver throughput */
+void solveStages ( int threads )
+{
+    sim::Level level;
+    string name;
+    for ( int k = 0; levelPack.load ( k, level, name ); k++ ) {
+        sim::Solver solver ( level, threads );
+        sim::Solution solution = solver.solve ( );
+
+        if ( ! solution.solved ) {
+            fprintf ( stdout, "level %d %s : unsolvable, %ld states in %.3f s\n", k + 1, name.c_str ( ), solution.nodes, solution.seconds );
+            continue;
+        }
+        string path;
+        for ( size_t m = 0; m < solution.moves.size ( ); m++ )
+            path += sim::moveName ( solution.moves[ m ] );
+        fprintf ( stdout, "level %d %s : %d moves %s, %ld states in %.3f s, %.2f M states/s\n",
+                  k + 1, name.c_str ( ), ( int ) solution.moves.size ( ), path.c_str ( ), solution.nodes, solution.seconds,
+                  solution.nodesPerSecond ( ) / 1e6 );
+    }
+}
+
+/* Average cost of a tick and of a frame over the session */
+void reportFrameTiming ( )
+{
+    if ( ! frameTiming.frames )
+        return;
+    fprintf ( stdout, "%ld ticks, %.3f ms of update per tick; %ld frames, %.3f ms of render per frame\n",
+              frameTiming.ticks, frameTiming.ticks ? frameTiming.updateSeconds * 1e3 / frameTiming.ticks : 0.0,
+              frameTiming.frames, frameTiming.renderSeconds * 1e3 / frameTiming.frames );
+    fprintf ( stdout, "GL state : %ld calls issued, %ld redundant calls skipped\n", glState.issued, glState.skipped );
+}
+
+/* Finish raising the board at once, as buildBlocksBoards would over the coming ticks */
+void settleBoard ( )
+{
+    for ( size_t t = 0; t < activeTiles.size ( ); t++ )
+        activeTiles[ t ].y_ordinate = activeTiles[ t ].y_previous = 0.0f;
+    boardCursor = 0;
+    movedBegin = movedEnd = 0;
+    stageStart = 0;
+}
+
+// Heap bytes a soak may end above its baseline by : the allocator drifts and the GL driver grows
+// its own pools in steps of 64 KB now and then, while even the smallest block lost per level
+// change grows past it within 10,000 changes
+const size_t soak_heap_slack = 256 * 1024;
+
+/* --soak : change level count times, round and round the pack.  After each change the board is
+   uploaded whole, settled and drawn twice, baked where baking is on : with its bridges as they
+   start, then with every bridge flipped, so the bridge indices are rewritten.  GL objects, their
+   storage and the heap are sampled whenever the first level comes round, and must be back where
+   the second round left them at the last, the heap within soak_heap_slack; the first round grows
+   the buffers that are reused, such as the instance buffer, to their size.  Returns the exit status */
+int soakLevels ( long count )
+{
+    struct Sample {
+        GPUStats gpu;
+        size_t heap;
+    } first = { }, last = { };
+
+    // the pack is scanned while the worker is idle
+    waitForPreparedLevel ( );
+    int levels = levelPack.count ( );
+    reportLevels = false;
+    long rounds = 0;
+    for ( long change = 1; change <= count; change++ ) {
+        level = change % levels + 1;
+        if ( ! loadLevel ( level - 1 ) )
+            return EXIT_FAILURE;
+        do
+            streamBoardUpload ( );
+        while ( bakeBoard && ! boardBaked );
+        settleBoard ( );
+        for ( int pass = 0; pass < 2; pass++ ) {
+            for ( int g = 0; pass && g < simLevel.bridges; g++ )
+                simState.bridges.press ( g, 0, 1 );
+            glClear ( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+            draw ( window, 0, 0, 1, 1, 0, views );
+            finishHeadlessFrame ( );
+        }
+        if ( level != 1 )
+            continue;
+
+        // the worker is done with the level after, so its allocations are in the sample
+        waitForPreparedLevel ( );
+        Sample sample = { gpuStats, mallinfo2 ( ).uordblks };
+        if ( ++rounds <= 2 )
+            first = sample;
+        last = sample;
+    }
+
+    bool flat = rounds > 2 && last.gpu.vertexArrays == first.gpu.vertexArrays && last.gpu.buffers == first.gpu.buffers &&
+                last.gpu.programs == first.gpu.programs && last.gpu.bytes == first.gpu.bytes && last.heap <= first.heap + soak_heap_slack;
+    fprintf ( stdout, "Soak : %ld level changes, %ld rounds of %d levels; %d vertex arrays, %d buffers, %d programs, "
+                      "%ld GPU bytes and %zu heap bytes live, from %d, %d, %d, %ld and %zu after round 2 : %s\n",
+              count, rounds, levels, last.gpu.vertexArrays, last.gpu.buffers, last.gpu.programs, last.gpu.bytes, last.heap,
+              first.gpu.vertexArrays, first.gpu.buffers, first.gpu.programs, first.gpu.bytes, first.heap,
+              rounds <= 2 ? "too few rounds to tell" : flat ? "flat" : "growing" );
+    return flat ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Where a recorded or replayed session ended, to compare a replay with its recording */
+void reportSession ( )
+{
+    recorder.close ( gameTick );
+    if ( fastReplay ) {
+        double seconds = wallSeconds ( ) - sessionStart;
+        fprintf ( stdout, "Replay : %llu ticks in %.3f s, %.0f ticks per second\n",
+                  ( unsigned long long ) gameTick, seconds, seconds > 0 ? gameTick / seconds : 0.0 );
+    }
+    fprintf ( stdout, "Session : seed %llu, tick %llu, level %d, %d moves, block at %d %d orientation %d\n",
+              ( unsigned long long ) gameSeed, ( unsigned long long ) gameTick, level, moves,
+              simState.row, simState.col, ( int ) simState.orientation );
+}
+
+/* Play a session log back without rendering, as fast as the CPU allows */
+void replayFast ( )
+{
+    initGame ( );
+    sessionStart = wallSeconds ( );
+    while ( ! player.finished ( gameTick ) )
+        update ( );
+}
+
+/* Write the benchmark summary next to each other as prefix.csv and prefix.json */
+void writeBenchmark ( const string &prefix )
+{
+    for ( int slot = 0; slot < gpu_query_frames; slot++ )
+        collectGpuPhases ( slot, true );
+
+    string csv = prefix + ".csv", json = prefix + ".json";
+    if ( ! profiler.writeCsv ( csv.c_str ( ) ) || ! profiler.writeJson ( json.c_str ( ) ) ) {
+        fprintf ( stderr, "cannot write %s or %s\n", csv.c_str ( ), json.c_str ( ) );
+        return;
+    }
+    fprintf ( stdout, "%d frames profiled, written to %s and %s\n", profiler.frames ( ), csv.c_str ( ), json.c_str ( ) );
+}
+
+/* Read every level of a pack, text or binary, and write them as a binary pack */
+int compilePack ( const char *in, const char *out )
+{
+    sim::LevelPack pack;
+    if ( ! pack.open ( in ) ) {
+        fprintf ( stderr, "%s\n", pack.error.c_str ( ) );
+        return EXIT_FAILURE;
+    }
+
+    vector < sim::Level > levels;
+    vector < string > names;
+    sim::Level level;
+    string name;
+    for ( int k = 0; pack.load ( k, level, name ); k++ ) {
+        levels.push_back ( level );
+        names.push_back ( name );
+    }
+    if ( ! pack.error.empty ( ) ) {
+        fprintf ( stderr, "%s : %s\n", in, pack.error.c_str ( ) );
+        return EXIT_FAILURE;
+    }
+    if ( ! sim::writeBinaryPack ( out, levels, names ) ) {
+        fprintf ( stderr, "cannot write %s\n", out );
+        return EXIT_FAILURE;
+    }
+    fprintf ( stdout, "%s : %d levels written to %s\n", in, ( int ) levels.size ( ), out );
+    return EXIT_SUCCESS;
+}
+
+/* Generate count levels in the band of options and write them as a pack, text when out ends
+   in .txt and binary otherwise */
+int generatePack ( const sim::GeneratorOptions &options, int count, int threads, const char *out )
+{
+    sim::GeneratorStats stats;
+    vector < sim::GeneratedLevel > generated = sim::generateLevels ( options, count, threads, gameSeed, stats );
+
+    vector < sim::Level > levels;
+    vector < string > names;
+    for ( size_t k = 0; k < generated.size ( ); k++ ) {
+        char name [ 64 ];
+        snprintf ( name, sizeof ( name ), "Generated %llu-%ld", ( unsigned long long ) gameSeed, generated[ k ].candidate );
+        levels.push_back ( generated[ k ].level );
+        names.push_back ( name );
+        fprintf ( stdout, "%s : %d moves, branching %d\n", name, generated[ k ].moves, generated[ k ].branching );
+    }
+
+    bool ok;
+    size_t length = strlen ( out );
+    if ( length > 4 && ! strcmp ( out + length - 4, ".txt" ) ) {
+        FILE *file = fopen ( out, "w" );
+        ok = file != NULL;
+        if ( file ) {
+            fprintf ( file, "# Generated levels, seed %llu, %d to %d moves\n", ( unsigned long long ) gameSeed, options.minMoves, options.maxMoves );
+            for ( size_t k = 0; k < levels.size ( ); k++ )
+                fprintf ( file, "\n%s", sim::formatTextLevel ( levels[ k ], names[ k ] ).c_str ( ) );
+            ok = fclose ( file ) == 0;
+        }
+    }
+    else
+        ok = sim::writeBinaryPack ( out, levels, names );
+    if ( ! ok ) {
+        fprintf ( stderr, "cannot write %s\n", out );
+        return EXIT_FAILURE;
+    }
+
+    fprintf ( stdout, "%ld of %ld candidates kept ( %ld solvable ) in %.2f s, %.0f levels per minute, written to %s\n",
+              stats.accepted, stats.candidates, stats.solvable, stats.seconds,
+              stats.seconds > 0 ? stats.accepted * 60 / stats.seconds : 0.0, out );
+    return stats.accepted == count ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int main ( int argc, char** argv )
@@ -1510,23 +3477,194 @@ int main ( int argc, char** argv )
     int width = 1000;
     int height = 1000;
 
-    window = initGLFW ( width, height );
+    int threads = 0;
+    long benchFrames = 0;
+    string benchPrefix = "bench";
+    string audioSink = "alsa";
+    const char *recordPath = NULL, *replayPath = NULL;
+    long soakChanges = 0;
+    for ( int a = 1; a < argc; a++ ) {
+        if ( ! strcmp ( argv[ a ], "--bench" ) && a + 1 < argc ) {
+            benchFrames = atol ( argv[ a + 1 ] );
+            // measure what the frame costs, not the wait for vsync
+            swapInterval = 0;
+            profiler.enabled = true;
+        }
+        if ( ! strcmp ( argv[ a ], "--bench-out" ) && a + 1 < argc )
+            benchPrefix = argv[ a + 1 ];
+        if ( ! strcmp ( argv[ a ], "--threads" ) && a + 1 < argc )
+            threads = atoi ( argv[ a + 1 ] );
+        if ( ! strcmp ( argv[ a ], "--levels" ) && a + 1 < argc )
+            levelPath = argv[ a + 1 ];
+        if ( ! strcmp ( argv[ a ], "--uncapped" ) )
+            swapInterval = 0;
+        if ( ! strcmp ( argv[ a ], "--split" ) )
+            splitScreen = 1;
+        if ( ! strcmp ( argv[ a ], "--no-bake" ) )
+            bakeBoard = 0;
+        if ( ! strcmp ( argv[ a ], "--headless" ) ) {
+            headless.enabled = true;
+            headless.frames = a + 1 < argc && isdigit ( argv[ a + 1 ][ 0 ] ) ? atol ( argv[ a + 1 ] ) : 0;
+        }
+        if ( ! strcmp ( argv[ a ], "--soak" ) && a + 1 < argc ) {
+            soakChanges = atol ( argv[ a + 1 ] );
+            headless.enabled = true;
+        }
+        if ( ! strcmp ( argv[ a ], "--record" ) && a + 1 < argc )
+            recordPath = argv[ a + 1 ];
+        if ( ! strcmp ( argv[ a ], "--replay" ) && a + 1 < argc )
+            replayPath = argv[ a + 1 ];
+        if ( ! strcmp ( argv[ a ], "--replay-fast" ) && a + 1 < argc ) {
+            replayPath = argv[ a + 1 ];
+            fastReplay = true;
+        }
+        if ( ! strcmp ( argv[ a ], "--seed" ) && a + 1 < argc )
+            gameSeed = strtoull ( argv[ a + 1 ], NULL, 10 );
+        if ( ! strcmp ( argv[ a ], "--audio" ) && a + 1 < argc )
+            audioSink = argv[ a + 1 ];
+        if ( ! strcmp ( argv[ a ], "--dump" ) && a + 1 < argc )
+            headless.dumpPrefix = argv[ a + 1 ];
+        if ( ! strcmp ( argv[ a ], "--dump-every" ) && a + 1 < argc )
+            headless.dumpEvery = max ( 1, atoi ( argv[ a + 1 ] ) );
+    }
+    if ( ! headless.dumpEvery )
+        headless.dumpEvery = 1;
+
+    // a replay takes its seed from the log, and a headless one runs to the end of it
+    if ( replayPath ) {
+        if ( ! player.open ( replayPath ) ) {
+            fprintf ( stderr, "%s : %s\n", replayPath, player.error.c_str ( ) );
+            exit ( EXIT_FAILURE );
+        }
+        gameSeed = player.log.seed;
+    }
+    if ( ! headless.frames )
+        headless.frames = player.active ? LONG_MAX : 600;
+    if ( recordPath && ! recorder.open ( recordPath, gameSeed ) ) {
+        fprintf ( stderr, "%s\n", recorder.error.c_str ( ) );
+        exit ( EXIT_FAILURE );
+    }
+    if ( recorder.recording ( ) || player.active )
+        atexit ( reportSession );
+    // no sound card to expect on a headless host
+    if ( headless.enabled && audioSink == "alsa" )
+        audioSink = "null";
+
+    for ( int a = 1; a < argc; a++ )
+        if ( ! strcmp ( argv[ a ], "--pack-compile" ) && a + 2 < argc )
+            return compilePack ( argv[ a + 1 ], argv[ a + 2 ] );
+
+    sim::GeneratorOptions generatorOptions;
+    for ( int a = 1; a < argc; a++ ) {
+        if ( ! strcmp ( argv[ a ], "--difficulty" ) && a + 1 < argc &&
+             sscanf ( argv[ a + 1 ], "%d-%d", &generatorOptions.minMoves, &generatorOptions.maxMoves ) != 2 ) {
+            fprintf ( stderr, "--difficulty takes MIN-MAX moves\n" );
+            exit ( EXIT_FAILURE );
+        }
+        if ( ! strcmp ( argv[ a ], "--switches" ) && a + 1 < argc )
+            generatorOptions.switches = atoi ( argv[ a + 1 ] );
+    }
+    for ( int a = 1; a < argc; a++ )
+        if ( ! strcmp ( argv[ a ], "--generate" ) && a + 2 < argc )
+            return generatePack ( generatorOptions, atoi ( argv[ a + 1 ] ), threads, argv[ a + 2 ] );
+
+    if ( ! levelPack.open ( levelPath ) ) {
+        fprintf ( stderr, "%s\n", levelPack.error.c_str ( ) );
+        exit ( EXIT_FAILURE );
+    }
+
+    for ( int a = 1; a < argc; a++ ) {
+        if ( ! strcmp ( argv[ a ], "--sim-bench" ) )
+            return simBenchmark ( a + 1 < argc ? atol ( argv[ a + 1 ] ) : 10000000 );
+        if ( ! strcmp ( argv[ a ], "--solve" ) ) {
+            solveStages ( threads );
+            return 0;
+        }
+    }
+    if ( fastReplay ) {
+        replayFast ( );
+        return 0;
+    }
+
+    if ( headless.enabled )
+        initHeadless ( width, height );
+    else
+        window = initGLFW ( width, height );
     initGLEW ( );
     initGL ( window, width, height );
+    initAudio ( audioSink );
 
-    double last_update_time = glfwGetTime ( ), current_time;
+    if ( soakChanges ) {
+        int status = soakLevels ( soakChanges );
+        releaseGLResources ( );
+        glfwTerminate ( );
+        return status;
+    }
+
+    atexit ( reportFrameTiming );
+
+    double last_update_time = clockSeconds ( ), current_time, accumulator = 0;
+
+    while ( headless.enabled ? headless.frame < headless.frames : ! glfwWindowShouldClose ( window ) ) {
+       beginProfiledFrame ( );
+       profiler.begin ( prof::PHASE_FRAME );
+
+        // Run as many fixed ticks as the time since the last frame holds; headless, exactly
+        // one, so frame k is drawn right after tick k at alpha 0 ( the clock difference is
+        // not exact and would leave 0 or 2 ticks in some frames )
+       profiler.begin ( prof::PHASE_UPDATE );
+       double update_start = wallSeconds ( );
+       current_time = clockSeconds ( );
+       accumulator += headless.enabled ? tick_seconds : min ( current_time - last_update_time, max_frame_seconds );
+       last_update_time = current_time;
+       while ( accumulator >= tick_seconds && ! player.finished ( gameTick ) ) {
+           update ( );
+           accumulator -= tick_seconds;
+           frameTiming.ticks++;
+       }
+       frameTiming.updateSeconds += wallSeconds ( ) - update_start;
+       profiler.end ( prof::PHASE_UPDATE );
+       if ( player.finished ( gameTick ) )
+           break;
 
-    while ( ! glfwWindowShouldClose ( window ) ) {
         // clear the color and depth in the frame buffer
+       double render_start = wallSeconds ( );
+       streamBoardUpload ( );
        glClear ( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
 
         // OpenGL Draw commands
-       draw ( window, 0, 0, 1, 1 );
-
-       glfwSwapBuffers ( window );
+       beginFragmentCount ( );
+       if ( splitScreen )
+           drawSplit ( window, accumulator / tick_seconds );
+       else
+           draw ( window, 0, 0, 1, 1, accumulator / tick_seconds, views );
+       endFragmentCount ( );
+
+       profiler.begin ( prof::PHASE_SWAP );
+       if ( headless.enabled )
+           finishHeadlessFrame ( );
+       else
+           glfwSwapBuffers ( window );
+       profiler.end ( prof::PHASE_SWAP );
+       frameTiming.renderSeconds += wallSeconds ( ) - render_start;
+       frameTiming.frames++;
 
         // Poll for Keyboard and mouse events
-       glfwPollEvents ( );
+       if ( window )
+           glfwPollEvents ( );
+
+       profiler.end ( prof::PHASE_FRAME );
+       endProfiledFrame ( );
+
+       // Edited shaders are picked up about twice a second
+       if ( frameTiming.frames % 30 == 0 && reloadShaderPrograms ( ) )
+           bindShaderPrograms ( );
+
+       if ( benchFrames && frameTiming.frames >= benchFrames ) {
+           writeBenchmark ( benchPrefix );
+           break;
+       }
     }
+    releaseGLResources ( );
     glfwTerminate ( );
 }
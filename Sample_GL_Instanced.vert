@@ -0,0 +1,29 @@
+#version 330 core
+
+// input data : shared cell mesh
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in float vertexShade;
+
+// input data : one entry per board tile
+layout (location = 2) in vec3 instanceOffset;
+layout (location = 3) in uint instancePalette;
+layout (location = 4) in float instanceVisible;
+
+uniform mat4 VP;
+
+// three face shades per palette entry
+uniform vec3 palette[48];
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+void main ()
+{
+    // Hidden tiles collapse to a point and produce no fragments
+    vec4 v = vec4(vertexPosition * instanceVisible + instanceOffset, 1);
+
+    fragColor = palette[instancePalette * 3u + uint(vertexShade)];
+
+    // Output position of the vertex, in clip space : VP * position
+    gl_Position = VP * v;
+}
@@ -0,0 +1,13 @@
+#version 330 core
+
+// Interpolated values from the geometry shader
+in vec3 viewColor;
+
+// output data
+out vec3 color;
+
+void main()
+{
+    // Output color = color of the view copy, as in Sample_GL.frag
+    color = viewColor;
+}
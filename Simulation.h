@@ -0,0 +1,599 @@
+#ifndef BLOXORZ_SIMULATION_H
+#define BLOXORZ_SIMULATION_H
+
+// Rules of the game on an integer grid, with no GL or GLFW dependency.
+// The renderer reads State to place the block and the tiles; everything
+// that decides where the block can go lives here.
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace sim {
+
+/* Tile kinds; binary level packs store these values, one byte per cell */
+enum Tile {
+    TILE_EMPTY = 0,
+    TILE_FLOOR = 1,
+    TILE_GOAL = 2,
+    TILE_FRAGILE = 3,
+    TILE_SWITCH = 4,        // toggles its bridges
+    TILE_SWITCH_ON = 5,     // only lowers them
+    TILE_SWITCH_OFF = 6,    // only raises them
+    TILE_BRIDGE = 7
+};
+
+inline bool switchTile ( int t )
+{
+    return t == TILE_SWITCH || t == TILE_SWITCH_ON || t == TILE_SWITCH_OFF;
+}
+
+/* STANDING covers one cell, LYING_ROW covers ( row, col ) and ( row + 1, col ),
+   LYING_COL covers ( row, col ) and ( row, col + 1 ) */
+enum Orientation {
+    STANDING = 0,
+    LYING_ROW = 1,
+    LYING_COL = 2
+};
+
+enum Move {
+    MOVE_UP,        // towards row 0
+    MOVE_DOWN,
+    MOVE_LEFT,      // towards column 0
+    MOVE_RIGHT
+};
+
+enum Outcome {
+    OUTCOME_OK,
+    OUTCOME_FALL,
+    OUTCOME_GOAL
+};
+
+// Bridge groups, one bit each in a BridgeMask; the last group number is
+// reserved for cells that belong to no group
+static const int bridge_words = 8;
+static const int max_bridges = bridge_words * 64 - 1;
+static const int no_group = max_bridges;
+
+/* One bit per bridge group, set while the bridge is down */
+struct BridgeMask {
+    uint64_t words [ bridge_words ];
+
+    void clear ( )
+    {
+        for ( int w = 0; w < bridge_words; w++ )
+            words[ w ] = 0;
+    }
+
+    uint64_t bit ( int group ) const
+    {
+        return ( words[ group >> 6 ] >> ( group & 63 ) ) & 1;
+    }
+
+    /* Press a switch of group : set the bit when set is 1, then flip it when flip is 1; a toggle
+       switch only flips, an on switch only sets and an off switch sets and flips */
+    void press ( int group, uint64_t set, uint64_t flip )
+    {
+        uint64_t &word = words[ group >> 6 ];
+        word = ( word | set << ( group & 63 ) ) ^ flip << ( group & 63 );
+    }
+};
+
+inline bool operator== ( const BridgeMask &a, const BridgeMask &b )
+{
+    return memcmp ( a.words, b.words, sizeof ( a.words ) ) == 0;
+}
+
+inline bool operator!= ( const BridgeMask &a, const BridgeMask &b )
+{
+    return ! ( a == b );
+}
+
+inline bool operator< ( const BridgeMask &a, const BridgeMask &b )
+{
+    return memcmp ( a.words, b.words, sizeof ( a.words ) ) < 0;
+}
+
+// Side of the square chunks the board is stored in
+static const int chunk_shift = 6;
+static const int chunk_size = 1 << chunk_shift;
+static const int chunk_mask = chunk_size - 1;
+
+/* The board in square chunks of chunk_size cells.  A directory with one entry
+   per chunk of the level, plus a ring of one chunk all around it, points to
+   the chunks that hold a tile; every other entry points to one empty chunk
+   shared by every board, so empty chunks take no memory and any cell a block
+   can roll onto, even off the edge, reads as empty without a bounds check.
+
+   Each chunk keeps the Tile values and bridge groups of its cells and derives
+   from them one bit per cell for each kind of tile, in two layouts : one word
+   per chunk row for each plane, for word parallel queries, and one byte of
+   plane bits per cell for scalar queries. */
+struct Bitboard {
+    enum Plane {
+        PLANE_SOLID,        // floor, goal, fragile and switch cells
+        PLANE_FRAGILE,
+        PLANE_GOAL,
+        PLANE_SWITCH,       // switches that flip their group : toggle and off switches
+        PLANE_BRIDGE,
+        PLANE_SWITCH_SET,   // switches that set their group first : on and off switches
+        plane_count
+    };
+
+    struct Chunk {
+        unsigned char tiles [ chunk_size * chunk_size ];    // Tile values
+        uint16_t groups [ chunk_size * chunk_size ];        // bridge group, no_group when none
+        unsigned char cells [ chunk_size * chunk_size ];    // 1 << plane for every plane holding the cell
+        uint64_t planes [ plane_count ][ chunk_size ];      // bit c of word r is cell ( r, c )
+
+        Chunk ( )
+        {
+            memset ( tiles, TILE_EMPTY, sizeof ( tiles ) );
+            std::fill ( groups, groups + chunk_size * chunk_size, ( uint16_t ) no_group );
+            memset ( cells, 0, sizeof ( cells ) );
+            memset ( planes, 0, sizeof ( planes ) );
+        }
+    };
+
+    int rows;
+    int cols;
+    int stride;                         // directory entries per row of chunks, ring included
+    std::vector < Chunk * > directory;  // chunk at every chunk position, empty ( ) when none
+    std::vector < Chunk * > chunks;     // owned, in the order they were claimed
+
+    Bitboard ( ) : rows ( 0 ), cols ( 0 ), stride ( 0 ) { }
+    ~Bitboard ( ) { release ( ); }
+
+    Bitboard ( const Bitboard &other ) : rows ( 0 ), cols ( 0 ), stride ( 0 ) { *this = other; }
+    Bitboard ( Bitboard &&other ) : rows ( 0 ), cols ( 0 ), stride ( 0 ) { swap ( other ); }
+
+    Bitboard &operator= ( const Bitboard &other )
+    {
+        if ( this == &other )
+            return *this;
+        resize ( other.rows, other.cols );
+        for ( size_t s = 0; s < other.directory.size ( ); s++ ) {
+            if ( other.occupied ( s ) ) {
+                chunks.push_back ( new Chunk ( *other.directory[ s ] ) );
+                directory[ s ] = chunks.back ( );
+            }
+        }
+        return *this;
+    }
+
+    Bitboard &operator= ( Bitboard &&other )
+    {
+        swap ( other );
+        return *this;
+    }
+
+    void swap ( Bitboard &other )
+    {
+        std::swap ( rows, other.rows );
+        std::swap ( cols, other.cols );
+        std::swap ( stride, other.stride );
+        directory.swap ( other.directory );
+        chunks.swap ( other.chunks );
+    }
+
+    /* The chunk every empty position points to; nothing ever writes to it */
+    static Chunk *empty ( )
+    {
+        static Chunk chunk;
+        return &chunk;
+    }
+
+    void release ( )
+    {
+        for ( size_t k = 0; k < chunks.size ( ); k++ )
+            delete chunks[ k ];
+        chunks.clear ( );
+    }
+
+    void resize ( int r, int c )
+    {
+        release ( );
+        rows = r;
+        cols = c;
+        stride = ( ( c + chunk_mask ) >> chunk_shift ) + 2;
+        directory.assign ( ( ( ( r + chunk_mask ) >> chunk_shift ) + 2 ) * stride, empty ( ) );
+    }
+
+    bool occupied ( size_t s ) const
+    {
+        return directory[ s ] != empty ( );
+    }
+
+    /* Directory entry of the chunk holding cell r, c; the shifts round down, so rows and
+       columns from -chunk_size to the far side of the ring land in the ring */
+    int slot ( int r, int c ) const
+    {
+        return ( ( r >> chunk_shift ) + 1 ) * stride + ( c >> chunk_shift ) + 1;
+    }
+
+    /* Position of cell r, c inside its chunk */
+    static int offset ( int r, int c )
+    {
+        return ( r & chunk_mask ) << chunk_shift | ( c & chunk_mask );
+    }
+
+    const Chunk &chunk ( int r, int c ) const
+    {
+        return *directory[ slot ( r, c ) ];
+    }
+
+    /* Chunk holding cell r, c, allocated on first use; r, c must be inside the level */
+    Chunk &claim ( int r, int c )
+    {
+        Chunk *&entry = directory[ slot ( r, c ) ];
+        if ( entry == empty ( ) ) {
+            entry = new Chunk ( );
+            chunks.push_back ( entry );
+        }
+        return *entry;
+    }
+
+    uint64_t bit ( int plane, int r, int c ) const
+    {
+        return ( chunk ( r, c ).cells[ offset ( r, c ) ] >> plane ) & 1;
+    }
+
+    int group ( int r, int c ) const
+    {
+        return chunk ( r, c ).groups[ offset ( r, c ) ];
+    }
+
+    /* Can the cell carry weight : solid, or a bridge whose group is down */
+    uint64_t support ( const BridgeMask &bridges, int r, int c ) const
+    {
+        const Chunk &k = chunk ( r, c );
+        int i = offset ( r, c );
+        return ( k.cells[ i ] & 1 ) | ( ( k.cells[ i ] >> PLANE_BRIDGE ) & bridges.bit ( k.groups[ i ] ) );
+    }
+
+    /* First cell from i on holding a tile, chunk_size squared when there is none; runs of
+       empty cells are skipped eight at a time */
+    static int nextTile ( const Chunk &k, int i )
+    {
+        const int end = chunk_size * chunk_size;
+        for ( ; i < end && ( i & 7 ); i++ )
+            if ( k.tiles[ i ] != TILE_EMPTY )
+                return i;
+        for ( ; i < end; i += 8 ) {
+            uint64_t word;
+            memcpy ( &word, k.tiles + i, 8 );
+            if ( word )
+                return i + __builtin_ctzll ( word ) / 8;
+        }
+        return end;
+    }
+
+    /* Derive the planes of a chunk from its tiles */
+    static void derive ( Chunk &k )
+    {
+        memset ( k.planes, 0, sizeof ( k.planes ) );
+        memset ( k.cells, 0, sizeof ( k.cells ) );
+        for ( int i = nextTile ( k, 0 ); i < chunk_size * chunk_size; i = nextTile ( k, i + 1 ) ) {
+            int t = k.tiles[ i ];
+            unsigned char bits = 1 << ( t == TILE_BRIDGE ? PLANE_BRIDGE : PLANE_SOLID );
+            if ( t == TILE_FRAGILE )
+                bits |= 1 << PLANE_FRAGILE;
+            if ( t == TILE_GOAL )
+                bits |= 1 << PLANE_GOAL;
+            if ( t == TILE_SWITCH || t == TILE_SWITCH_OFF )
+                bits |= 1 << PLANE_SWITCH;
+            if ( t == TILE_SWITCH_ON || t == TILE_SWITCH_OFF )
+                bits |= 1 << PLANE_SWITCH_SET;
+            k.cells[ i ] = bits;
+            for ( int p = 0; p < plane_count; p++ )
+                k.planes[ p ][ i >> chunk_shift ] |= ( uint64_t ) ( ( bits >> p ) & 1 ) << ( i & chunk_mask );
+        }
+    }
+};
+
+struct Level {
+    int rows;
+    int cols;
+    int startRow;
+    int startCol;
+    int bridges;
+
+    Bitboard board;         // tiles and groups, set cell by cell, and the planes derived by build ( )
+
+    // Cells of every bridge group as r * cols + c, group g's from bridgeStart [ g ] up to
+    // bridgeStart [ g + 1 ], so whatever presses a switch reaches its bridges directly
+    std::vector < uint32_t > bridgeStart;
+    std::vector < uint32_t > bridgeCells;
+
+    Level ( ) : rows ( 0 ), cols ( 0 ), startRow ( 0 ), startCol ( 0 ), bridges ( 0 ) { }
+
+    void resize ( int r, int c )
+    {
+        rows = r;
+        cols = c;
+        board.resize ( r, c );
+    }
+
+    bool inside ( int r, int c ) const
+    {
+        return r >= 0 && c >= 0 && r < rows && c < cols;
+    }
+
+    int tile ( int r, int c ) const
+    {
+        return inside ( r, c ) ? board.chunk ( r, c ).tiles[ Bitboard::offset ( r, c ) ] : ( int ) TILE_EMPTY;
+    }
+
+    int groupAt ( int r, int c ) const
+    {
+        int g = inside ( r, c ) ? board.group ( r, c ) : no_group;
+        return g == no_group ? -1 : g;
+    }
+
+    /* Set the tile of a cell inside the level; empty cells of empty chunks stay unallocated */
+    void setTile ( int r, int c, int t )
+    {
+        if ( t != TILE_EMPTY || board.occupied ( board.slot ( r, c ) ) )
+            board.claim ( r, c ).tiles[ Bitboard::offset ( r, c ) ] = t;
+    }
+
+    /* Bridge group of a switch or bridge cell, -1 for none */
+    void setGroup ( int r, int c, int g )
+    {
+        if ( g >= 0 || board.occupied ( board.slot ( r, c ) ) )
+            board.claim ( r, c ).groups[ Bitboard::offset ( r, c ) ] = g < 0 ? no_group : g;
+    }
+
+    /* Number of chunks holding tiles */
+    int chunkCount ( ) const
+    {
+        return board.chunks.size ( );
+    }
+
+    /* Call visit ( r, c, tile ) for every cell holding a tile : chunk by chunk in row major
+       order of the chunks, row major inside each; the bounding box is never walked */
+    template < class Visit >
+    void forEachTile ( Visit visit ) const
+    {
+        for ( size_t s = 0; s < board.directory.size ( ); s++ ) {
+            if ( ! board.occupied ( s ) )
+                continue;
+            const Bitboard::Chunk &k = *board.directory[ s ];
+            int r0 = ( s / board.stride - 1 ) << chunk_shift, c0 = ( s % board.stride - 1 ) << chunk_shift;
+            for ( int i = Bitboard::nextTile ( k, 0 ); i < chunk_size * chunk_size; i = Bitboard::nextTile ( k, i + 1 ) )
+                visit ( r0 + ( i >> chunk_shift ), c0 + ( i & chunk_mask ), ( int ) k.tiles[ i ] );
+        }
+    }
+
+    /* Call visit ( r, c, group ) for every bridge cell, found from the bridge planes alone */
+    template < class Visit >
+    void forEachBridge ( Visit visit ) const
+    {
+        for ( size_t s = 0; s < board.directory.size ( ); s++ ) {
+            if ( ! board.occupied ( s ) )
+                continue;
+            const Bitboard::Chunk &k = *board.directory[ s ];
+            int r0 = ( s / board.stride - 1 ) << chunk_shift, c0 = ( s % board.stride - 1 ) << chunk_shift;
+            for ( int r = 0; r < chunk_size; r++ ) {
+                for ( uint64_t bits = k.planes[ Bitboard::PLANE_BRIDGE ][ r ]; bits; bits &= bits - 1 ) {
+                    int c = __builtin_ctzll ( bits );
+                    visit ( r0 + r, c0 + c, ( int ) k.groups[ r << chunk_shift | c ] );
+                }
+            }
+        }
+    }
+
+    /* Derive the bitplanes and the bridge cells of every group once tiles and groups are filled in */
+    void build ( )
+    {
+        for ( size_t k = 0; k < board.chunks.size ( ); k++ )
+            Bitboard::derive ( *board.chunks[ k ] );
+
+        // counted, then placed group by group
+        bridgeStart.assign ( bridges + 1, 0 );
+        forEachBridge ( [ & ] ( int, int, int g ) {
+            if ( g < bridges )
+                bridgeStart[ g + 1 ]++;
+        } );
+        for ( int g = 0; g < bridges; g++ )
+            bridgeStart[ g + 1 ] += bridgeStart[ g ];
+        bridgeCells.resize ( bridgeStart[ bridges ] );
+        std::vector < uint32_t > next ( bridgeStart.begin ( ), bridgeStart.end ( ) - 1 );
+        forEachBridge ( [ & ] ( int r, int c, int g ) {
+            if ( g < bridges )
+                bridgeCells[ next[ g ]++ ] = ( uint32_t ) r * cols + c;
+        } );
+    }
+
+    /* Word parallel form : fill live with the rows of a chunk's solid plane plus every bridge cell that is down */
+    static void livePlane ( const BridgeMask &bridges, const Bitboard::Chunk &k, uint64_t live [ chunk_size ] )
+    {
+        for ( int r = 0; r < chunk_size; r++ ) {
+            live[ r ] = k.planes[ Bitboard::PLANE_SOLID ][ r ];
+            for ( uint64_t bits = k.planes[ Bitboard::PLANE_BRIDGE ][ r ]; bits; bits &= bits - 1 ) {
+                int c = __builtin_ctzll ( bits );
+                live[ r ] |= ( bits & -bits ) * bridges.bit ( k.groups[ r << chunk_shift | c ] );
+            }
+        }
+    }
+
+    /* Word parallel form : for row r of a chunk's live plane, the bits of every position the block
+       can rest on standing, lying along the rows and lying along the columns; below and right are
+       the live planes of the chunks under it and to its right, for the cells past its edges */
+    static void restMasks ( const Bitboard::Chunk &k, const uint64_t live [ chunk_size ], const uint64_t below [ chunk_size ],
+                            const uint64_t right [ chunk_size ], int r, uint64_t &standing, uint64_t &lyingRow, uint64_t &lyingCol )
+    {
+        uint64_t next = r + 1 < chunk_size ? live[ r + 1 ] : below[ 0 ];
+        standing = live[ r ] & ~k.planes[ Bitboard::PLANE_FRAGILE ][ r ];
+        lyingRow = live[ r ] & next;
+        lyingCol = live[ r ] & ( ( live[ r ] >> 1 ) | ( right[ r ] << 63 ) );
+    }
+};
+
+struct State {
+    int row;
+    int col;
+    Orientation orientation;
+    BridgeMask bridges;
+};
+
+inline bool operator== ( const State &a, const State &b )
+{
+    return a.row == b.row && a.col == b.col && a.orientation == b.orientation && a.bridges == b.bridges;
+}
+
+/* Block standing on the start cell, every bridge up */
+inline State initialState ( const Level &level )
+{
+    State state;
+    state.row = level.startRow;
+    state.col = level.startCol;
+    state.orientation = STANDING;
+    state.bridges.clear ( );
+    return state;
+}
+
+/* Second cell covered by the block, equal to the first when standing */
+inline void otherCell ( const State &state, int &r, int &c )
+{
+    r = state.row + ( state.orientation == LYING_ROW );
+    c = state.col + ( state.orientation == LYING_COL );
+}
+
+/* Can the cell carry weight, given which bridges are down */
+inline bool supports ( const Level &level, const BridgeMask &bridges, int r, int c )
+{
+    return level.board.support ( bridges, r, c );
+}
+
+/* Is the bridge cell at r, c currently down */
+inline bool bridgeDown ( const Level &level, const State &state, int r, int c )
+{
+    return level.inside ( r, c ) && level.board.bit ( Bitboard::PLANE_BRIDGE, r, c ) & state.bridges.bit ( level.board.group ( r, c ) );
+}
+
+/* Classify a resting block with a handful of bit operations and no branches */
+inline Outcome evaluate ( const Level &level, const State &state )
+{
+    int r, c;
+    otherCell ( state, r, c );
+
+    const Bitboard &board = level.board;
+    uint64_t flags = board.chunk ( state.row, state.col ).cells[ Bitboard::offset ( state.row, state.col ) ];
+    uint64_t standing = state.orientation == STANDING;
+    uint64_t held = board.support ( state.bridges, state.row, state.col ) & board.support ( state.bridges, r, c );
+    uint64_t fall = ( held ^ 1 ) | ( standing & ( flags >> Bitboard::PLANE_FRAGILE ) & 1 );
+    uint64_t goal = standing & ( flags >> Bitboard::PLANE_GOAL ) & ( fall ^ 1 ) & 1;
+    return ( Outcome ) ( fall | ( goal << 1 ) );
+}
+
+/* Compare the word parallel rest masks of every chunk holding a tile with evaluate ( ) on each of
+   its cells, in all three orientations, for the given bridges.  Adds the positions compared to
+   checked and returns how many disagree */
+inline long checkRestMasks ( const Level &level, const BridgeMask &bridges, long &checked )
+{
+    const Bitboard &board = level.board;
+    uint64_t live [ chunk_size ], below [ chunk_size ], right [ chunk_size ], masks [ 3 ];
+    State state;
+    state.bridges = bridges;
+    long mismatches = 0;
+    for ( size_t s = 0; s < board.directory.size ( ); s++ ) {
+        if ( ! board.occupied ( s ) )
+            continue;
+        // chunks in the level always have the ring below and to their right
+        Level::livePlane ( bridges, *board.directory[ s ], live );
+        Level::livePlane ( bridges, *board.directory[ s + board.stride ], below );
+        Level::livePlane ( bridges, *board.directory[ s + 1 ], right );
+        int r0 = ( s / board.stride - 1 ) << chunk_shift, c0 = ( s % board.stride - 1 ) << chunk_shift;
+        for ( int r = 0; r < chunk_size; r++ ) {
+            Level::restMasks ( *board.directory[ s ], live, below, right, r, masks[ STANDING ], masks[ LYING_ROW ], masks[ LYING_COL ] );
+            for ( int c = 0; c < chunk_size; c++ ) {
+                for ( int o = STANDING; o <= LYING_COL; o++ ) {
+                    state.row = r0 + r;
+                    state.col = c0 + c;
+                    state.orientation = ( Orientation ) o;
+                    bool rests = evaluate ( level, state ) != OUTCOME_FALL;
+                    mismatches += rests != ( ( masks[ o ] >> c ) & 1 );
+                    checked++;
+                }
+            }
+        }
+    }
+    return mismatches;
+}
+
+/* Roll the block one step; next is filled in whatever the outcome so a fall can be animated */
+inline Outcome step ( const Level &level, const State &state, Move move, State &next )
+{
+    // row / column delta and resulting orientation for every ( orientation, move ) pair
+    static const signed char roll [ 3 ][ 4 ][ 3 ] = {
+        //   UP            DOWN            LEFT            RIGHT
+        { { -2, 0, LYING_ROW }, { 1, 0, LYING_ROW }, { 0, -2, LYING_COL }, { 0, 1, LYING_COL } },  // STANDING
+        { { -1, 0, STANDING },  { 2, 0, STANDING },  { 0, -1, LYING_ROW }, { 0, 1, LYING_ROW } },  // LYING_ROW
+        { { -1, 0, LYING_COL }, { 1, 0, LYING_COL }, { 0, -1, STANDING },  { 0, 2, STANDING } }    // LYING_COL
+    };
+
+    const signed char *r = roll[ state.orientation ][ move ];
+    next.row = state.row + r[ 0 ];
+    next.col = state.col + r[ 1 ];
+    next.orientation = ( Orientation ) r[ 2 ];
+    next.bridges = state.bridges;
+
+    Outcome outcome = evaluate ( level, next );
+    if ( outcome != OUTCOME_OK )
+        return outcome;
+
+    // Landing on a switch presses it; the second cell is the first when standing, and pressed once
+    int r2, c2;
+    otherCell ( next, r2, c2 );
+    const Bitboard::Chunk &ka = level.board.chunk ( next.row, next.col ), &kb = level.board.chunk ( r2, c2 );
+    int a = Bitboard::offset ( next.row, next.col ), b = Bitboard::offset ( r2, c2 );
+    uint64_t second = next.orientation != STANDING;
+    next.bridges.press ( ka.groups[ a ], ( ka.cells[ a ] >> Bitboard::PLANE_SWITCH_SET ) & 1, ( ka.cells[ a ] >> Bitboard::PLANE_SWITCH ) & 1 );
+    next.bridges.press ( kb.groups[ b ], ( kb.cells[ b ] >> Bitboard::PLANE_SWITCH_SET ) & second, ( kb.cells[ b ] >> Bitboard::PLANE_SWITCH ) & second );
+
+    return OUTCOME_OK;
+}
+
+/* Small deterministic generator for benchmarks and tools */
+struct Random {
+    uint64_t seed;
+
+    explicit Random ( uint64_t s = 0x9E3779B97F4A7C15ull ) : seed ( s ? s : 1 ) { }
+
+    uint64_t next ( )
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        return seed;
+    }
+
+    int below ( int n )
+    {
+        return ( int ) ( next ( ) % ( uint64_t ) n );
+    }
+};
+
+/* Play random moves, restarting after every fall or goal, and return the number of goals reached */
+inline long randomWalk ( const Level &level, long steps, Random &random )
+{
+    State state = initialState ( level ), next;
+    long goals = 0;
+    for ( long i = 0; i < steps; i++ ) {
+        Outcome outcome = step ( level, state, ( Move ) ( random.next ( ) & 3 ), next );
+        if ( outcome == OUTCOME_OK )
+            state = next;
+        else {
+            goals += outcome == OUTCOME_GOAL;
+            state = initialState ( level );
+        }
+    }
+    return goals;
+}
+
+}
+
+#endif
@@ -0,0 +1,286 @@
+#ifndef BLOXORZ_SOLVER_H
+#define BLOXORZ_SOLVER_H
+
+// Shortest solution of a level by breadth first search over
+// ( block cell, orientation, lowered bridges ).  Each BFS layer is
+// expanded by a pool of worker threads sharing one lock-free visited set.
+
+#include "Simulation.h"
+
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+namespace sim {
+
+struct Solution {
+    bool solved;
+    std::vector < Move > moves;     // shortest move sequence from the start
+    long nodes;                     // states expanded
+    double seconds;
+    int branching;                  // widest BFS layer
+
+    double nodesPerSecond ( ) const
+    {
+        return seconds > 0 ? nodes / seconds : 0;
+    }
+};
+
+/* Visited set : open addressing on 64 bit keys, each slot also remembers how it was reached */
+class VisitedSet {
+public:
+    explicit VisitedSet ( size_t capacity ) { reset ( capacity ); }
+
+    void reset ( size_t capacity )
+    {
+        size_t size = 1024;
+        while ( size < capacity * 2 )
+            size <<= 1;
+        mask = size - 1;
+        count = 0;
+        keys = std::vector < std::atomic < uint64_t > > ( size );
+        for ( size_t i = 0; i < size; i++ )
+            keys[ i ].store ( 0, std::memory_order_relaxed );
+        parents.assign ( size, 0 );
+        moves.assign ( size, 0 );
+    }
+
+    /* Insert key, returning false if it was already present */
+    bool insert ( uint64_t key, uint64_t parent, Move move )
+    {
+        for ( size_t i = hash ( key ) & mask; ; i = ( i + 1 ) & mask ) {
+            uint64_t current = keys[ i ].load ( std::memory_order_relaxed );
+            if ( current == key )
+                return false;
+            if ( current == 0 ) {
+                if ( keys[ i ].compare_exchange_strong ( current, key ) ) {
+                    parents[ i ] = parent;
+                    moves[ i ] = move;
+                    count.fetch_add ( 1, std::memory_order_relaxed );
+                    return true;
+                }
+                if ( current == key )
+                    return false;
+            }
+        }
+    }
+
+    /* Slot holding key, which must be present */
+    size_t find ( uint64_t key ) const
+    {
+        size_t i = hash ( key ) & mask;
+        while ( keys[ i ].load ( std::memory_order_relaxed ) != key )
+            i = ( i + 1 ) & mask;
+        return i;
+    }
+
+    bool crowded ( size_t incoming ) const
+    {
+        return ( count.load ( ) + incoming ) * 2 > mask;
+    }
+
+    /* Double the table; only called between layers, with no worker running */
+    void grow ( size_t incoming )
+    {
+        std::vector < uint64_t > oldKeys, oldParents;
+        std::vector < unsigned char > oldMoves;
+        for ( size_t i = 0; i <= mask; i++ ) {
+            uint64_t key = keys[ i ].load ( std::memory_order_relaxed );
+            if ( key ) {
+                oldKeys.push_back ( key );
+                oldParents.push_back ( parents[ i ] );
+                oldMoves.push_back ( moves[ i ] );
+            }
+        }
+        reset ( ( oldKeys.size ( ) + incoming ) * 2 );
+        for ( size_t k = 0; k < oldKeys.size ( ); k++ )
+            insert ( oldKeys[ k ], oldParents[ k ], ( Move ) oldMoves[ k ] );
+    }
+
+    uint64_t parentOf ( size_t slot ) const { return parents[ slot ]; }
+    Move moveOf ( size_t slot ) const { return ( Move ) moves[ slot ]; }
+
+private:
+    static uint64_t hash ( uint64_t key )
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ull;
+        key ^= key >> 33;
+        return key;
+    }
+
+    size_t mask;
+    std::atomic < size_t > count;
+    std::vector < std::atomic < uint64_t > > keys;
+    std::vector < uint64_t > parents;
+    std::vector < unsigned char > moves;
+};
+
+class Solver {
+public:
+    explicit Solver ( const Level &l, int threads = 0 ) : level ( l ), visited ( 1 << 12 )
+    {
+        workers = threads > 0 ? threads : ( int ) std::thread::hardware_concurrency ( );
+        if ( workers < 1 )
+            workers = 1;
+    }
+
+    Solution solve ( )
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ( );
+
+        Solution solution;
+        solution.solved = false;
+        solution.nodes = 0;
+        solution.branching = 1;
+
+        masks.clear ( );
+        maskIds.clear ( );
+        found.store ( false );
+        expanded.store ( 0 );
+
+        Node root;
+        root.state = initialState ( level );
+        root.key = key ( root.state, intern ( root.state.bridges ) );
+        visited.reset ( 1 << 12 );
+        visited.insert ( root.key, 0, MOVE_UP );
+
+        std::vector < Node > frontier ( 1, root );
+        if ( evaluate ( level, root.state ) == OUTCOME_OK ) {
+            while ( ! frontier.empty ( ) && ! found.load ( ) ) {
+                if ( visited.crowded ( frontier.size ( ) * 4 ) )
+                    visited.grow ( frontier.size ( ) * 4 );
+                frontier = expand ( frontier );
+                if ( ( int ) frontier.size ( ) > solution.branching )
+                    solution.branching = frontier.size ( );
+            }
+        }
+
+        if ( found.load ( ) ) {
+            solution.solved = true;
+            solution.moves.push_back ( goalMove );
+            for ( uint64_t k = goalParent; k != root.key; ) {
+                size_t slot = visited.find ( k );
+                solution.moves.push_back ( visited.moveOf ( slot ) );
+                k = visited.parentOf ( slot );
+            }
+            std::vector < Move > reversed ( solution.moves.rbegin ( ), solution.moves.rend ( ) );
+            solution.moves.swap ( reversed );
+        }
+
+        solution.nodes = expanded.load ( );
+        solution.seconds = std::chrono::duration < double > ( std::chrono::steady_clock::now ( ) - start ).count ( );
+        return solution;
+    }
+
+private:
+    struct Node {
+        uint64_t key;
+        State state;
+    };
+
+    /* ( mask id + 1 ) in the high half so no key is 0, cell and orientation in the low half */
+    uint64_t key ( const State &state, uint32_t maskId ) const
+    {
+        uint64_t position = ( ( uint64_t ) state.row * level.cols + state.col ) * 3 + state.orientation;
+        return ( ( uint64_t ) ( maskId + 1 ) << 32 ) | position;
+    }
+
+    uint32_t intern ( const BridgeMask &bridges )
+    {
+        std::lock_guard < std::mutex > lock ( maskLock );
+        std::map < BridgeMask, uint32_t >::iterator it = maskIds.find ( bridges );
+        if ( it != maskIds.end ( ) )
+            return it->second;
+        uint32_t id = masks.size ( );
+        masks.push_back ( bridges );
+        maskIds[ bridges ] = id;
+        return id;
+    }
+
+    /* Expand one BFS layer, frontier split between the workers in small batches */
+    std::vector < Node > expand ( const std::vector < Node > &frontier )
+    {
+        std::atomic < size_t > cursor ( 0 );
+        int count = frontier.size ( ) < 256 ? 1 : workers;
+        std::vector < std::vector < Node > > produced ( count );
+
+        std::vector < std::thread > pool;
+        for ( int w = 1; w < count; w++ )
+            pool.push_back ( std::thread ( &Solver::work, this, std::cref ( frontier ), std::ref ( cursor ), std::ref ( produced[ w ] ) ) );
+        work ( frontier, cursor, produced[ 0 ] );
+        for ( size_t w = 0; w < pool.size ( ); w++ )
+            pool[ w ].join ( );
+
+        std::vector < Node > next;
+        for ( int w = 0; w < count; w++ )
+            next.insert ( next.end ( ), produced[ w ].begin ( ), produced[ w ].end ( ) );
+        return next;
+    }
+
+    void work ( const std::vector < Node > &frontier, std::atomic < size_t > &cursor, std::vector < Node > &out )
+    {
+        const size_t batch = 64;
+        long done = 0;
+        for ( ; ; ) {
+            size_t begin = cursor.fetch_add ( batch );
+            if ( begin >= frontier.size ( ) || found.load ( std::memory_order_relaxed ) )
+                break;
+            size_t end = std::min ( begin + batch, frontier.size ( ) );
+            for ( size_t i = begin; i < end; i++ ) {
+                const Node &node = frontier[ i ];
+                uint32_t maskId = ( uint32_t ) ( node.key >> 32 ) - 1;
+                for ( int m = 0; m < 4; m++ ) {
+                    Node child;
+                    Outcome outcome = step ( level, node.state, ( Move ) m, child.state );
+                    if ( outcome == OUTCOME_FALL )
+                        continue;
+                    if ( outcome == OUTCOME_GOAL ) {
+                        std::lock_guard < std::mutex > lock ( maskLock );
+                        if ( ! found.load ( ) ) {
+                            goalParent = node.key;
+                            goalMove = ( Move ) m;
+                            found.store ( true );
+                        }
+                        continue;
+                    }
+                    uint32_t childMask = child.state.bridges == node.state.bridges ? maskId : intern ( child.state.bridges );
+                    child.key = key ( child.state, childMask );
+                    if ( visited.insert ( child.key, node.key, ( Move ) m ) )
+                        out.push_back ( child );
+                }
+            }
+            done += end - begin;
+        }
+        expanded.fetch_add ( done );
+    }
+
+    const Level &level;
+    int workers;
+    VisitedSet visited;
+
+    std::mutex maskLock;
+    std::vector < BridgeMask > masks;
+    std::map < BridgeMask, uint32_t > maskIds;
+
+    std::atomic < bool > found;
+    std::atomic < long > expanded;
+    uint64_t goalParent;
+    Move goalMove;
+};
+
+/* Letter for each move : U D L R */
+inline char moveName ( Move move )
+{
+    return "UDLR"[ move ];
+}
+
+}
+
+#endif